@@ -4,17 +4,74 @@
 
 struct shell;
 
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_TRACING)
+#include <zephyr/tracing/tracing.h>
+
+/* Begin/end markers for the phases of a slot switch. Keep phases short, CTF caps event names at 20 bytes. */
+#define KEYMAP_SHELL_TRACE_BEGIN(phase, arg) sys_trace_named_event("ks_" phase "_begin", (uint32_t)(arg), 0)
+#define KEYMAP_SHELL_TRACE_END(phase, arg) sys_trace_named_event("ks_" phase "_end", (uint32_t)(arg), 0)
+#else
+#define KEYMAP_SHELL_TRACE_BEGIN(phase, arg) do { } while (0)
+#define KEYMAP_SHELL_TRACE_END(phase, arg) do { } while (0)
+#endif
+
 void keymap_restore();
 int keymap_shell_activate_slot(uint8_t slot_idx);
 
+/* Applies a slot to the live keymap without storing it, so the stored keymap comes back on reboot.
+ * Requires CONFIG_ZMK_KEYMAP_SHELL_DIRECT_APPLY; returns -ENOTSUP if the slot can't be applied live. */
+int keymap_shell_activate_slot_temp(uint8_t slot_idx);
+
+#define KEYMAP_SHELL_REQUEST_RESTORE -1
+
+/* Where a slot switch came from, for "keymap stats". */
+enum keymap_shell_source {
+    KEYMAP_SHELL_SOURCE_SHELL,
+    KEYMAP_SHELL_SOURCE_BEHAVIOR,
+    KEYMAP_SHELL_SOURCE_OUTPUT,
+};
+
+typedef void (*keymap_shell_request_cb)(int err, void *user_data);
+
+/* Queues activation of a slot (or KEYMAP_SHELL_REQUEST_RESTORE) on the keymap work queue and returns.
+ * A request that hasn't started yet is replaced, and its callback gets -ECANCELED from the caller's
+ * thread. Otherwise cb runs on the work queue once the slot is applied. */
+int keymap_shell_request_slot(int slot_idx, enum keymap_shell_source source, keymap_shell_request_cb cb,
+                              void *user_data);
+
+/* Like keymap_shell_request_slot(), for the slot with a stable ID. The slots are loaded and the ID looked
+ * up on the work queue, so the caller never waits on storage; cb gets -ENOENT if no slot has the ID. */
+int keymap_shell_request_slot_id(uint16_t id, enum keymap_shell_source source, keymap_shell_request_cb cb,
+                                 void *user_data);
+
 /* Loads slots from settings if not already initialized. Returns 0. */
 int keymap_shell_ensure_initialized(void);
 
 /* Resolves a slot identifier (1-based index or name) to a 0-based index, or -1. */
 int keymap_shell_resolve_slot(const char *str);
 
-/* Returns the name of an occupied slot, or NULL if free/unnamed/out of range. */
-const char *keymap_shell_slot_name(uint8_t slot_idx);
+/* Copies the name of an occupied slot into name (size bytes, truncated if needed). Returns false, leaving
+ * name untouched, if the slot is free, unnamed or out of range. */
+bool keymap_shell_slot_name(uint8_t slot_idx, char *name, size_t size);
+
+/* Returns true if the stored keymap overrides (and bistable slot) matched the slot with this ID when they
+ * were last read, nothing was written since, and the live keymap has no unsaved changes on top of them.
+ * Lock-free and never touches storage, so it can be called from the system work queue; false when in
+ * doubt, in which case activating the slot finds out whether anything needs writing. */
+bool keymap_shell_slot_id_is_active(uint16_t id);
+
+/* Returns the stable ID of an occupied slot, kept across overwrites, or 0. */
+uint16_t keymap_shell_slot_id(uint8_t slot_idx);
+
+/* Resolves a slot ID to a 0-based index, or -1 if no slot has it. */
+int keymap_shell_find_slot_id(uint16_t id);
+
+/* Asks for a slot to be decoded into the cache in the background, ahead of its activation.
+ * Does nothing unless CONFIG_ZMK_KEYMAP_SHELL_PREFETCH is enabled. */
+void keymap_shell_prefetch_slot(uint8_t slot_idx);
+
+/* Like keymap_shell_prefetch_slot(), for the slot with a stable ID, looked up on the work queue. */
+void keymap_shell_prefetch_slot_id(uint16_t id);
 
 /* Shell handler for "keymap assign" (defined in the output_keymap service). */
 int keymap_assign_cmd(const struct shell *sh, size_t argc, char **argv);
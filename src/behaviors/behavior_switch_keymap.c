@@ -45,18 +45,8 @@ static const struct behavior_parameter_metadata_set metadata_sets[] = {profile_i
 static const struct behavior_parameter_metadata metadata = { .sets_len = ARRAY_SIZE(metadata_sets), .sets = metadata_sets};
 #endif
 
-// ReSharper disable once CppParameterMayBeConstPtrOrRef
-static int on_skmp_binding_pressed(struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event event) {
-    const struct device* dev = zmk_behavior_get_binding(binding->behavior_dev);
-    const struct behavior_switch_keymap_config *cfg = dev->config;
-    const uint8_t slot_idx = binding->param1 - 1;
-    int err = 0;
-
-    if (binding->param1 == 0) {
-        keymap_restore();
-    } else {
-        err = keymap_shell_activate_slot(slot_idx);
-    }
+static void on_skmp_request_done(const int err, void *user_data) {
+    const struct behavior_switch_keymap_config *cfg = user_data;
 
 #if IS_ENABLED(CONFIG_ZMK_FEEDBACK_COMMON)
     if (err == 0 && cfg->feedback_duration > 0) {
@@ -66,6 +56,20 @@ static int on_skmp_binding_pressed(struct zmk_behavior_binding *binding, struct
     ARG_UNUSED(err);
     ARG_UNUSED(cfg);
 #endif
+}
+
+// ReSharper disable once CppParameterMayBeConstPtrOrRef
+static int on_skmp_binding_pressed(struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event event) {
+    const struct device* dev = zmk_behavior_get_binding(binding->behavior_dev);
+    const struct behavior_switch_keymap_config *cfg = dev->config;
+
+    /* Runs on the keymap work queue; a press before the previous one is handled replaces it. */
+    const int slot_idx = binding->param1 == 0 ? KEYMAP_SHELL_REQUEST_RESTORE : (int)binding->param1 - 1;
+    const int err = keymap_shell_request_slot(slot_idx, KEYMAP_SHELL_SOURCE_BEHAVIOR, on_skmp_request_done,
+                                              (void *)cfg);
+    if (err != 0) {
+        LOG_ERR("Failed to queue keymap slot %d: %d", binding->param1, err);
+    }
 
     return ZMK_BEHAVIOR_OPAQUE;
 }
@@ -1,5 +1,6 @@
 #include <zephyr/kernel.h>
 #include <zephyr/init.h>
+#include <zephyr/logging/log.h>
 #include <zephyr/settings/settings.h>
 #include <zephyr/shell/shell.h>
 #include <zephyr/sys/util.h>
@@ -11,9 +12,12 @@
 #include <zmk/ble.h>
 #include <zmk/event_manager.h>
 #include <zmk/events/endpoint_changed.h>
+#include <zmk/events/ble_active_profile_changed.h>
 
 #include "drivers/keymap_shell.h"
 
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
 #if IS_ENABLED(CONFIG_ZMK_KEYMAP_OUTPUT_ASSIGN)
 
 #if IS_ENABLED(CONFIG_ZMK_RUNTIME_CONFIG)
@@ -24,9 +28,23 @@
 
 #define KMA_ENABLED_KEY "keymap/autoswitch"
 #define KMA_EP_COUNT   (1 + ZMK_BLE_PROFILE_COUNT)
-static char assign_names[KMA_EP_COUNT][CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+/* Assigned slot IDs per endpoint, stored as "kto/id/<ep>". Set by the shell and the boot sync, read by
+ * the system work queue, so only through assigned_id() and set_assigned_id(). */
+static uint16_t assign_ids[KMA_EP_COUNT];
+static struct k_spinlock assign_lock;
 static bool ready;
 
+/* Activations started by output changes, and those skipped as debounced, redundant or superseded. */
+static atomic_t applied_count;
+static atomic_t suppressed_count;
+
+/* The boot sync runs once settings are loaded and an output is selected; the boot delay only bounds the
+ * wait, for when neither shows up. */
+#define BOOT_SETTINGS BIT(0)
+#define BOOT_OUTPUT   BIT(1)
+static atomic_t boot_conditions;
+static const char *boot_trigger;
+
 static int endpoint_to_epkey(const struct zmk_endpoint_instance ep) {
     if (ep.transport == ZMK_TRANSPORT_BLE) {
         return 1 + ep.ble.profile_index;
@@ -48,7 +66,36 @@ static int target_to_epkey(const char *s) {
     return -1;
 }
 
-static void apply_endpoint(const struct zmk_endpoint_instance ep) {
+static uint16_t assigned_id(const int epkey) {
+    const k_spinlock_key_t key = k_spin_lock(&assign_lock);
+    const uint16_t id = assign_ids[epkey];
+    k_spin_unlock(&assign_lock, key);
+    return id;
+}
+
+static void set_assigned_id(const int epkey, const uint16_t id) {
+    const k_spinlock_key_t key = k_spin_lock(&assign_lock);
+    assign_ids[epkey] = id;
+    k_spin_unlock(&assign_lock, key);
+}
+
+static void on_activation_done(const int err, void *user_data) {
+    if (err == 0) {
+        atomic_inc(&applied_count);
+    } else if (err == -ECANCELED) {
+        atomic_inc(&suppressed_count);
+    }
+}
+
+/* How long after boot the output's slot was in place, for the boot sync. */
+static void on_boot_activation_done(const int err, void *user_data) {
+    on_activation_done(err, user_data);
+    if (err == 0) {
+        LOG_INF("Output slot active %u ms after boot", k_uptime_get_32());
+    }
+}
+
+static void apply_endpoint(const struct zmk_endpoint_instance ep, const bool boot) {
     if (!ZRC_GET(KMA_ENABLED_KEY, 1)) {
         return;
     }
@@ -58,8 +105,8 @@ static void apply_endpoint(const struct zmk_endpoint_instance ep) {
         return;
     }
 
-    const char *name = assign_names[epkey];
-    if (name[0] == '\0') {
+    const uint16_t id = assigned_id(epkey);
+    if (id == 0) {
         return;
     }
 
@@ -75,56 +122,186 @@ static void apply_endpoint(const struct zmk_endpoint_instance ep) {
         }
     }
 
-    keymap_shell_ensure_initialized();
-    const int idx = keymap_shell_resolve_slot(name);
-    if (idx < 0) {
+    if (keymap_shell_slot_id_is_active(id)) {
+        atomic_inc(&suppressed_count);
+        if (boot) {
+            LOG_INF("Output slot already active %u ms after boot", k_uptime_get_32());
+        }
         return;
     }
-    keymap_shell_activate_slot((uint8_t)idx);
+    /* Slots are loaded and the ID looked up on the keymap work queue, not here. */
+    keymap_shell_request_slot_id(id, KEYMAP_SHELL_SOURCE_OUTPUT, boot ? on_boot_activation_done : on_activation_done,
+                                 NULL);
 }
 
 static void activate_work_handler(struct k_work *work) {
     if (ready) {
-        apply_endpoint(zmk_endpoints_selected());
+        KEYMAP_SHELL_TRACE_BEGIN("endpoint", 0);
+        apply_endpoint(zmk_endpoints_selected(), false);
+        KEYMAP_SHELL_TRACE_END("endpoint", 0);
     }
 }
-static K_WORK_DEFINE(activate_work, activate_work_handler);
+static K_WORK_DELAYABLE_DEFINE(activate_work, activate_work_handler);
+
+/* What the boot sync reads from "kto". */
+struct stored_assignments {
+    uint16_t ids[KMA_EP_COUNT];
+    char legacy_names[KMA_EP_COUNT][CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+};
 
 static int load_cb(const char *key, const size_t len, const settings_read_cb read_cb,
                    void *cb_arg, void *param) {
+    struct stored_assignments *stored = param;
+
     char *endptr;
+    const char *next;
+    if (settings_name_steq(key, "id", &next) && next) {
+        const unsigned long ep = strtoul(next, &endptr, 10);
+        if (*endptr == '\0' && ep < KMA_EP_COUNT && len == sizeof(stored->ids[ep])) {
+            read_cb(cb_arg, &stored->ids[ep], sizeof(stored->ids[ep]));
+        }
+        return 0;
+    }
+
+    /* Assignments stored by slot name, before slots had IDs. */
     const unsigned long ep = strtoul(key, &endptr, 10);
     if (*endptr != '\0' || ep >= KMA_EP_COUNT) {
         return 0;
     }
 
     const size_t n = MIN(len, (size_t)(CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX - 1));
-    const ssize_t rd = read_cb(cb_arg, assign_names[ep], n);
-    assign_names[ep][rd > 0 ? rd : 0] = '\0';
+    const ssize_t rd = read_cb(cb_arg, stored->legacy_names[ep], n);
+    stored->legacy_names[ep][rd > 0 ? rd : 0] = '\0';
     return 0;
 }
 
+static int save_assignment(const int epkey, const uint16_t id) {
+    char key[24];
+    snprintf(key, sizeof(key), "kto/id/%d", epkey);
+    const int err = id != 0 ? settings_save_one(key, &id, sizeof(id)) : settings_delete(key);
+    if (err == 0) {
+        set_assigned_id(epkey, id);
+    }
+    return err;
+}
+
+/* Converts name-based assignments to slot IDs; names that no longer resolve are dropped. */
+static void migrate_assignments(char legacy_names[][CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX]) {
+    bool changed = false;
+    for (int ep = 0; ep < KMA_EP_COUNT; ep++) {
+        if (legacy_names[ep][0] == '\0') {
+            continue;
+        }
+
+        if (assigned_id(ep) == 0) {
+            /* Only ever after an upgrade; names need the slots loaded. */
+            keymap_shell_ensure_initialized();
+            const int idx = keymap_shell_resolve_slot(legacy_names[ep]);
+            const uint16_t id = idx >= 0 ? keymap_shell_slot_id((uint8_t)idx) : 0;
+            if (id == 0) {
+                LOG_WRN("Dropping assignment of output %d: slot \"%s\" not found", ep, legacy_names[ep]);
+            } else if (save_assignment(ep, id) != 0) {
+                continue;
+            }
+        }
+
+        char key[16];
+        snprintf(key, sizeof(key), "kto/%d", ep);
+        settings_delete(key);
+        changed = true;
+    }
+
+    if (changed) {
+        settings_commit();
+    }
+}
+
 static void boot_sync_work(struct k_work *work) {
-    memset(assign_names, 0, sizeof(assign_names));
-    settings_load_subtree_direct("kto", load_cb, NULL);
+    if (ready) {
+        return;
+    }
+
+    LOG_INF("Syncing output slot %u ms after boot (%s)", k_uptime_get_32(),
+            boot_trigger != NULL ? boot_trigger : "timeout");
+    struct stored_assignments stored;
+    memset(&stored, 0, sizeof(stored));
+    settings_load_subtree_direct("kto", load_cb, &stored);
+    for (int ep = 0; ep < KMA_EP_COUNT; ep++) {
+        set_assigned_id(ep, stored.ids[ep]);
+    }
+    migrate_assignments(stored.legacy_names);
+
     ready = true;
-    apply_endpoint(zmk_endpoints_selected());
+    KEYMAP_SHELL_TRACE_BEGIN("endpoint", 0);
+    apply_endpoint(zmk_endpoints_selected(), true);
+    KEYMAP_SHELL_TRACE_END("endpoint", 0);
+
+    if (ZRC_GET(KMA_ENABLED_KEY, 1)) {
+        /* Slots of the other outputs, so switching to one doesn't wait on storage. */
+        for (int ep = 0; ep < KMA_EP_COUNT; ep++) {
+            keymap_shell_prefetch_slot_id(assigned_id(ep));
+        }
+    }
 }
 static K_WORK_DELAYABLE_DEFINE(boot_work, boot_sync_work);
 
-static int output_keymap_listener(const zmk_event_t *eh) {
+static void boot_condition_met(const atomic_val_t condition, const char *trigger) {
     if (ready) {
-        k_work_submit(&activate_work);
+        return;
+    }
+
+    const atomic_val_t met = atomic_or(&boot_conditions, condition) | condition;
+    if (!(met & BOOT_SETTINGS)) {
+        return;
+    }
+
+    /* Loading settings selects the output, and no event follows when it stays the default one, so it
+     * gets one debounce period to show up. */
+    boot_trigger = trigger;
+    k_work_reschedule(&boot_work,
+                      (met & BOOT_OUTPUT) ? K_NO_WAIT : K_MSEC(CONFIG_ZMK_KEYMAP_OUTPUT_ASSIGN_DEBOUNCE_MS));
+}
+
+/* Runs after every settings load or commit; only the first one, at boot, matters here. */
+static int output_keymap_settings_commit(void) {
+    boot_condition_met(BOOT_SETTINGS, "settings");
+    return 0;
+}
+
+/* Assignments are read by the boot sync itself, which also converts name-based ones. */
+static int output_keymap_settings_set(const char *key, const size_t len, const settings_read_cb read_cb,
+                                      void *cb_arg) {
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(output_keymap, "kto", NULL, output_keymap_settings_set,
+                               output_keymap_settings_commit, NULL);
+
+static int output_keymap_listener(const zmk_event_t *eh) {
+    if (!ready) {
+        boot_condition_met(BOOT_OUTPUT, as_zmk_endpoint_changed(eh) != NULL ? "endpoint" : "BLE profile");
+        return ZMK_EV_EVENT_BUBBLE;
+    }
+
+    if (as_zmk_endpoint_changed(eh) != NULL) {
+        if (k_work_delayable_is_pending(&activate_work)) {
+            atomic_inc(&suppressed_count);
+        }
+        k_work_reschedule(&activate_work, K_MSEC(CONFIG_ZMK_KEYMAP_OUTPUT_ASSIGN_DEBOUNCE_MS));
     }
     return ZMK_EV_EVENT_BUBBLE;
 }
 ZMK_LISTENER(output_keymap, output_keymap_listener);
 ZMK_SUBSCRIPTION(output_keymap, zmk_endpoint_changed);
+ZMK_SUBSCRIPTION(output_keymap, zmk_ble_active_profile_changed);
 
 static int output_keymap_init(void) {
 #if IS_ENABLED(CONFIG_ZMK_RUNTIME_CONFIG)
     zrc_register(KMA_ENABLED_KEY, 1, 0, 1);
 #endif
+    ready = false;
+    atomic_set(&boot_conditions, 0);
+    boot_trigger = NULL;
     k_work_schedule(&boot_work, K_MSEC(CONFIG_ZMK_KEYMAP_OUTPUT_ASSIGN_BOOT_DELAY_MS));
     return 0;
 }
@@ -132,6 +309,7 @@ SYS_INIT(output_keymap_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
 
 int keymap_assign_cmd(const struct shell *sh, const size_t argc, char **argv) {
     if (argc == 1) {
+        keymap_shell_ensure_initialized();
         shell_print(sh, "Output assignments:");
         for (int ep = 0; ep < KMA_EP_COUNT; ep++) {
             char label[16];
@@ -140,9 +318,26 @@ int keymap_assign_cmd(const struct shell *sh, const size_t argc, char **argv) {
             } else {
                 snprintf(label, sizeof(label), "wireless-%d", ep);
             }
-            shell_print(sh, "  %-12s %s", label,
-                        assign_names[ep][0] ? assign_names[ep] : "(none)");
+
+            const uint16_t id = assigned_id(ep);
+            if (id == 0) {
+                shell_print(sh, "  %-12s (none)", label);
+                continue;
+            }
+
+            const int idx = keymap_shell_find_slot_id(id);
+            if (idx < 0) {
+                shell_print(sh, "  %-12s (slot deleted)", label);
+            } else {
+                char name[CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+                if (!keymap_shell_slot_name((uint8_t)idx, name, sizeof(name))) {
+                    strcpy(name, "unnamed");
+                }
+                shell_print(sh, "  %-12s slot %d (%s)", label, idx + 1, name);
+            }
         }
+        shell_print(sh, "Activations: %d applied, %d suppressed", (int)atomic_get(&applied_count),
+                    (int)atomic_get(&suppressed_count));
         return 0;
     }
 
@@ -152,13 +347,9 @@ int keymap_assign_cmd(const struct shell *sh, const size_t argc, char **argv) {
         return -EINVAL;
     }
 
-    char key[24];
-    snprintf(key, sizeof(key), "kto/%d", epkey);
-
     if (argc == 2) {
-        settings_delete(key);
+        save_assignment(epkey, 0);
         settings_commit();
-        assign_names[epkey][0] = '\0';
         shell_print(sh, "Cleared assignment for %s.", argv[1]);
         return 0;
     }
@@ -170,27 +361,23 @@ int keymap_assign_cmd(const struct shell *sh, const size_t argc, char **argv) {
         return -ENOENT;
     }
 
-    const char *name = keymap_shell_slot_name((uint8_t)idx);
-    if (name == NULL) {
-        shell_print(sh, "That slot is empty or unnamed. Name it first with \"keymap save\".");
+    const uint16_t id = keymap_shell_slot_id((uint8_t)idx);
+    if (id == 0) {
+        shell_print(sh, "That slot is empty. Save a keymap to it first with \"keymap save\".");
         return -EINVAL;
     }
 
-    const size_t len = strlen(name);
-    if (len >= CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX) {
-        shell_print(sh, "Slot name too long (max %d).", CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX - 1);
-        return -ENAMETOOLONG;
-    }
-
-    const int err = settings_save_one(key, name, len);
+    const int err = save_assignment(epkey, id);
     if (err != 0) {
         shell_print(sh, "Failed to save assignment! Error code = %d", err);
         return err;
     }
     settings_commit();
 
-    memcpy(assign_names[epkey], name, len);
-    assign_names[epkey][len] = '\0';
+    char name[CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+    if (!keymap_shell_slot_name((uint8_t)idx, name, sizeof(name))) {
+        strcpy(name, "unnamed");
+    }
     shell_print(sh, "Assigned %s -> slot %d (%s).", argv[1], idx + 1, name);
     return 0;
 }
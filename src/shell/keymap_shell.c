@@ -3,10 +3,18 @@
 #include <zephyr/device.h>
 #include <zephyr/shell/shell.h>
 #include <zephyr/sys/util.h>
+#include <zephyr/sys/sys_heap.h>
+/* sys_heap internals from zephyr/lib, for reading the free lists in "keymap mem". */
+#include <heap/heap.h>
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/crc.h>
+#include "zmk/event_manager.h"
 #include "zmk/keymap.h"
 #include "zmk/matrix.h"
 #include "zmk/studio/core.h"
+#if IS_ENABLED(CONFIG_ZMK_STUDIO_RPC)
+#include "zmk/studio/rpc.h"
+#endif
 #include "drivers/keymap_shell.h"
 
 #define DT_DRV_COMPAT zmk_keymap_shell
@@ -35,41 +43,214 @@ do { \
     shell_print((_sh), _fmt, ##__VA_ARGS__); \
 } while (0)
 
-struct binding_entry {
-    ssize_t length;
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+};
+
+/* Bump allocator owned by a slot: grows in chunks, released all at once by free_slot. */
+struct slot_arena {
+    struct arena_chunk* head;
+    size_t reserved;
+};
+
+/* One settings record of a packed slot ("slots/<n>/p/<index>"), kept until the walk is over. */
+struct blob_fragment {
+    struct blob_fragment* next;
     uint16_t index;
+    uint16_t length;
+    uint8_t data[];
+};
+
+/* One binding override; a slot keeps them in a single table sorted by layer, then position. */
+struct binding_entry {
     uint8_t* data;
+    uint16_t index;
+    uint8_t layer;
+    uint8_t length;
 };
 
+/* The bindings of one layer: a run of a slot's binding table. */
 struct layer_bindings {
+    const struct binding_entry* entries;
     uint16_t count;
-    struct binding_entry* entries;
 };
 
+struct layer_name {
+    uint8_t* data;
+    uint8_t layer;
+    uint8_t length;
+};
+
+/* Same layout as ZMK's stored binding record; trailing zero params may be omitted. */
+struct binding_setting {
+    zmk_behavior_local_id_t behavior_local_id;
+    uint32_t param1;
+    uint32_t param2;
+} __packed;
+
 struct keymap_slot {
-    struct layer_bindings bindings[ZMK_KEYMAP_LAYERS_LEN];
+    struct slot_arena arena;
 
-    ssize_t names_size[ZMK_KEYMAP_LAYERS_LEN];
-    uint8_t* names_data[ZMK_KEYMAP_LAYERS_LEN];
+    /* Both tables come from the arena and only hold what the slot overrides, sorted by layer. */
+    struct binding_entry* bindings;
+    uint16_t binding_count;
+    uint16_t binding_capacity;
 
-    ssize_t order_size;
+    struct layer_name* names;
+    uint8_t name_count;
+    uint8_t name_capacity;
+
+    uint8_t order_size;
     uint8_t* order_data;
 
     uint16_t total_size;
     const char* name;
 
+    /* Order-independent hash of order, layer names and bindings; equal content, equal fingerprint. */
+    uint32_t fingerprint;
+
     bool is_free;
 
+    /* Packed records read while loading the slot, until they are assembled. */
+    struct blob_fragment* fragments;
+    /* Shared layers read in the same walk as the fragments, if any. */
+    const struct shared_load_param* shared_preload;
+
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    bool has_bistable;
+    uint8_t bistable_slot;
+#endif
+};
+
+/* Names a shared layer record by two independent hashes of its contents. */
+struct shared_ref {
+    uint32_t crc;
+    uint32_t hash;
+} __packed;
+
+#define SHARED_LAYER_TREE "slots/s"
+#define SHARED_REFS_UNKNOWN UINT8_MAX
+
+/*
+ * Leads the first packed record, before the layer order: header, name, shared layer references and
+ * the uncompressed size.
+ */
+#define SLOT_BLOB_HEAD_MAX                                                                          \
+    (sizeof(struct slot_blob_header) + CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX + 1 +                  \
+     ZMK_KEYMAP_LAYERS_LEN * sizeof(struct shared_ref) + sizeof(uint16_t))
+
+/* What is kept for every slot; bindings and layer names are only read when a slot is used. */
+struct slot_meta {
+    char name[CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+    uint16_t id;
+    uint16_t size;
+    /* Size before compression; same as size when the slot isn't compressed, 0 if unknown. */
+    uint16_t raw_size;
+    uint32_t fingerprint;
+
+    bool is_free;
+
+    /* Storage bookkeeping: number of packed records, per-key records left over. */
+    uint8_t blob_chunks;
+    bool legacy;
+
 #if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
     bool has_bistable;
     uint8_t bistable_slot;
 #endif
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    /*
+     * Shared layer records the slot refers to, in a table from the heap; SHARED_REFS_UNKNOWN if
+     * they didn't fit the first record.
+     */
+    uint8_t shared_count;
+    struct shared_ref* shared;
+#endif
+};
+
+/*
+ * Packed slot format: a header, the slot name and layer order, then one layer record per layer
+ * with a name or bindings, each followed by its binding records. The blob is split into
+ * CONFIG_ZMK_KEYMAP_SHELL_BLOB_CHUNK_SIZE records when it doesn't fit a single one.
+ *
+ * With SLOT_BLOB_F_SHARED, a table of shared layer references follows the name, and a layer record
+ * counting SLOT_BLOB_SHARED_LAYER bindings is followed by an index into that table instead: its
+ * bindings live in "slots/s/<ref>" (a binding count, then the binding records), stored once for
+ * every slot with the same layer.
+ *
+ * With SLOT_BLOB_F_COMPRESSED, the order and layer records that follow are LZSS-compressed, after
+ * their uncompressed size (16 bits). Header size and CRC then describe the stored, compressed blob.
+ */
+#define SLOT_BLOB_MAGIC 0x4B53
+#define SLOT_BLOB_VERSION 1
+#define SLOT_BLOB_F_BISTABLE BIT(0)
+#define SLOT_BLOB_F_SHARED BIT(1)
+#define SLOT_BLOB_F_COMPRESSED BIT(2)
+#define SLOT_BLOB_SHARED_LAYER UINT16_MAX
+
+struct slot_blob_header {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t size;
+    uint32_t crc;
+    uint8_t name_len;
+    uint8_t order_len;
+    uint8_t layer_count;
+    uint8_t bistable_slot;
+    uint32_t fingerprint;
+    uint16_t id;
+} __packed;
+
+struct slot_blob_layer {
+    uint8_t layer;
+    uint8_t name_len;
+    uint16_t count;
+} __packed;
+
+struct slot_blob_binding {
+    uint16_t index;
+    uint8_t length;
+} __packed;
+
+struct payload_cache_entry {
+    struct keymap_slot slot;
+    int8_t slot_idx;
+    uint32_t last_used;
+};
+
+/* Enough entries to switch between a few hot slots; CONFIG_ZMK_KEYMAP_SHELL_CACHE_BYTES bounds their memory. */
+#define PAYLOAD_CACHE_ENTRIES MIN(CONFIG_ZMK_KEYMAP_SHELL_SLOTS, 4)
+
+struct payload_cache {
+    struct payload_cache_entry entries[PAYLOAD_CACHE_ENTRIES];
+    /* A slot still in use while another is loaded; not evicted to make room. */
+    int8_t pinned;
+    uint32_t clock;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
 };
 
 struct keymap_shell_config {
     bool initialized;
-    struct keymap_slot slots[CONFIG_ZMK_KEYMAP_SHELL_SLOTS];
+    struct slot_meta slots[CONFIG_ZMK_KEYMAP_SHELL_SLOTS];
+    uint16_t next_id;
     struct keymap_slot system;
+    struct payload_cache cache;
+    /* What storage_generation was when the state was last read. */
+    uint32_t loaded_generation;
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    /* Shared layer records present in storage, in a table from the heap. */
+    struct shared_ref* shared;
+    uint16_t shared_count;
+    uint16_t shared_capacity;
+#endif
 };
 
 struct cb_param {
@@ -79,30 +260,453 @@ struct cb_param {
 
 static struct keymap_shell_config config;
 
-static int clear_slot_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
-    const size_t sz = strlen(key) + 16;
-    char* name_buffer = malloc(sz);
-    if (name_buffer == NULL) {
-        LOG_ERR("Failed to allocate memory for key name!");
-        return -ENOMEM;
+/*
+ * Guards config, the payload cache and the slot arenas, which the shell thread, the keymap work queue
+ * and the system work queue (through output assignment) all use. Recursive for its owner, so the
+ * public functions take it even when called with it held. Never held while waiting on a work item.
+ */
+static K_MUTEX_DEFINE(state_lock);
+
+static void state_lock_take(void) {
+    k_mutex_lock(&state_lock, K_FOREVER);
+}
+
+static void state_lock_give(void) {
+    k_mutex_unlock(&state_lock);
+}
+
+/* The ID of the slot the stored overrides match, under the low 16 bits of the storage_generation they were
+ * read at, or 0. Read without state_lock by keymap_shell_slot_id_is_active(). */
+static atomic_t active_slot;
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+/* The bistable slot of the published slot plus one, or 0 for the default one. */
+static atomic_t active_bistable;
+#endif
+
+/* Bumped by every settings write the module makes, every settings commit and every ZMK Studio keymap
+ * change, so the state read from storage can be reused until something may have changed it. */
+static atomic_t storage_generation;
+
+#if IS_ENABLED(CONFIG_ZMK_STUDIO_RPC)
+/* ZMK Studio edits and saves the keymap without going through this module; each change notifies. */
+static int studio_rpc_listener(const zmk_event_t *eh) {
+    if (as_zmk_studio_rpc_notification(eh) != NULL) {
+        atomic_inc(&storage_generation);
     }
+    return ZMK_EV_EVENT_BUBBLE;
+}
+
+ZMK_LISTENER(keymap_shell_rpc, studio_rpc_listener);
+ZMK_SUBSCRIPTION(keymap_shell_rpc, zmk_studio_rpc_notification);
+#endif
+
+/* Activations and background writes run here, off the key event and system work queue paths. */
+static K_THREAD_STACK_DEFINE(keymap_work_stack, CONFIG_ZMK_KEYMAP_SHELL_WORKQUEUE_STACK_SIZE);
+static struct k_work_q keymap_work_q;
 
-    snprintf(name_buffer, sz, "%s/%s", *(const char **) param, key);
-    const int rc = settings_delete(name_buffer);
-    free(name_buffer);
-    return rc;
+/* Slot data comes from a heap of its own, so a big keymap can't starve or fragment the system heap. */
+static K_HEAP_DEFINE(keymap_heap, CONFIG_ZMK_KEYMAP_SHELL_HEAP_SIZE);
+
+static void* heap_alloc(const size_t size) {
+    void* ptr = k_heap_alloc(&keymap_heap, size, K_NO_WAIT);
+    if (ptr == NULL) {
+        LOG_ERR("Keymap shell heap exhausted (%d bytes requested)!", (int)size);
+    }
+    return ptr;
 }
 
-static void clear_slot(const char* key) {
-    const int err = settings_load_subtree_direct(key, clear_slot_cb, &key);
-    if (err != 0) {
-        LOG_ERR("Failed to clear slot: %d", err);
+static void heap_free(void* ptr) {
+    k_heap_free(&keymap_heap, ptr);
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+static void slot_meta_release_shared(struct slot_meta* meta) {
+    if (meta->shared != NULL) {
+        heap_free(meta->shared);
+    }
+    meta->shared = NULL;
+    meta->shared_count = 0;
+}
+#endif
+
+static void slot_meta_reset(struct slot_meta* meta) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    slot_meta_release_shared(meta);
+#endif
+    memset(meta, 0, sizeof(*meta));
+    meta->is_free = true;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_USAGE_COUNTERS)
+/* Settings traffic, for the performance counters. */
+struct usage_counters {
+    uint32_t saves;
+    uint32_t deletes;
+    uint32_t walks;
+    uint32_t records;
+    size_t bytes_read;
+    size_t bytes_written;
+};
+
+static struct usage_counters usage;
+
+struct storage_walk_param {
+    settings_load_direct_cb cb;
+    void *param;
+};
+
+struct storage_read_param {
+    settings_read_cb read_cb;
+    void *cb_arg;
+};
+
+static ssize_t storage_read_cb(void *cb_arg, void *data, const size_t len) {
+    const struct storage_read_param *read = cb_arg;
+    const ssize_t size = read->read_cb(read->cb_arg, data, len);
+    if (size > 0) {
+        usage.bytes_read += size;
+    }
+    return size;
+}
+
+static int storage_walk_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    const struct storage_walk_param *walk = param;
+    struct storage_read_param read = { .read_cb = read_cb, .cb_arg = cb_arg };
+    usage.records++;
+    return walk->cb(key, len, storage_read_cb, &read, walk->param);
+}
+
+struct op_timing {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+};
+
+static void timing_add(struct op_timing *timing, const uint32_t cycles) {
+    timing->min_cycles = timing->count == 0 ? cycles : MIN(timing->min_cycles, cycles);
+    timing->max_cycles = MAX(timing->max_cycles, cycles);
+    timing->total_cycles += cycles;
+    timing->count++;
+}
+#endif
+
+/* Settings access goes through these, so it can be counted. */
+static int storage_save(const char *key, const void *data, const size_t len) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_USAGE_COUNTERS)
+    usage.saves++;
+    usage.bytes_written += len;
+#endif
+    atomic_inc(&storage_generation);
+    return settings_save_one(key, data, len);
+}
+
+static int storage_delete(const char *key) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_USAGE_COUNTERS)
+    usage.deletes++;
+#endif
+    atomic_inc(&storage_generation);
+    return settings_delete(key);
+}
+
+static int storage_walk(const char *subtree, const settings_load_direct_cb cb, void *param) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_USAGE_COUNTERS)
+    usage.walks++;
+    struct storage_walk_param walk = { .cb = cb, .param = param };
+    return settings_load_subtree_direct(subtree, storage_walk_cb, &walk);
+#else
+    return settings_load_subtree_direct(subtree, cb, param);
+#endif
+}
+
+enum stats_op {
+    STATS_LOAD,
+    STATS_SAVE,
+    STATS_CLEAR,
+    STATS_ACTIVATE,
+    STATS_RESTORE,
+    STATS_OPS,
+};
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_STATS)
+#define STATS_SOURCES (KEYMAP_SHELL_SOURCE_OUTPUT + 1)
+
+/* Not synchronized between the shell and the work queue; good enough for diagnostics. */
+static struct {
+    struct op_timing ops[STATS_OPS];
+    uint32_t activations[STATS_SOURCES];
+} stats;
+#endif
+
+static inline uint32_t stats_start(void) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_STATS)
+    return k_cycle_get_32();
+#else
+    return 0;
+#endif
+}
+
+static inline void stats_stop(const enum stats_op op, const uint32_t start) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_STATS)
+    timing_add(&stats.ops[op], k_cycle_get_32() - start);
+#endif
+}
+
+static inline void stats_count_activation(const enum keymap_shell_source source) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_STATS)
+    if (source < STATS_SOURCES) {
+        state_lock_take();
+        stats.activations[source]++;
+        state_lock_give();
+    }
+#endif
+}
+
+/* Relative keys collected per walk; a subtree with more records than this takes another walk. */
+#define DELETE_BATCH_KEYS 16
+#define DELETE_KEY_MAX 24
+
+struct delete_batch {
+    bool keep_packed;
+    bool full;
+    uint8_t count;
+    char keys[DELETE_BATCH_KEYS][DELETE_KEY_MAX];
+};
+
+static int delete_batch_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    struct delete_batch *batch = param;
+    const char *next;
+    if (key == NULL || (batch->keep_packed && settings_name_steq(key, "p", &next))) {
+        return 0;
+    }
+
+    if (batch->count == DELETE_BATCH_KEYS) {
+        batch->full = true;
+        return 0;
+    }
+
+    const size_t key_len = strlen(key);
+    if (key_len >= DELETE_KEY_MAX) {
+        LOG_ERR("Key \"%s\" is too long to delete", key);
+        return 0;
     }
 
-    settings_delete(key);
+    memcpy(batch->keys[batch->count++], key, key_len + 1);
+    return 0;
+}
+
+/*
+ * Deletes the records under prefix, except its packed ones with keep_packed. Keys are gathered on
+ * the stack during the walk and deleted after it, so storage isn't written while being iterated.
+ */
+static void delete_subtree(const char *prefix, const bool keep_packed) {
+    struct delete_batch batch = { .keep_packed = keep_packed };
+    char name[DELETE_KEY_MAX + 16];
+
+    do {
+        batch.count = 0;
+        batch.full = false;
+        const int err = storage_walk(prefix, delete_batch_cb, &batch);
+        if (err != 0) {
+            LOG_ERR("Failed to clear slot: %d", err);
+            return;
+        }
+
+        for (uint8_t i = 0; i < batch.count; i++) {
+            snprintf(name, sizeof(name), "%s/%s", prefix, batch.keys[i]);
+            if (storage_delete(name) != 0) {
+                LOG_ERR("Failed to delete %s", name);
+                return;
+            }
+        }
+    } while (batch.full);
+}
+
+static void clear_slot(const char* key) {
+    delete_subtree(key, false);
+    storage_delete(key);
     settings_commit();
 }
 
+/* Deletes the per-key records of a slot, keeping its packed records. */
+static void clear_slot_legacy(const uint8_t slot_idx) {
+    char key[16];
+    snprintf(key, sizeof(key), "slots/%d", slot_idx);
+    delete_subtree(key, true);
+}
+
+static void* arena_alloc(struct slot_arena* arena, size_t size) {
+    size = ROUND_UP(MAX(size, 1), sizeof(void*));
+
+    struct arena_chunk* chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        const size_t chunk_size = MAX(size, CONFIG_ZMK_KEYMAP_SHELL_ARENA_CHUNK_SIZE);
+        /* The live keymap is never capped: it holds whatever the keymap currently overrides. */
+        if (CONFIG_ZMK_KEYMAP_SHELL_ARENA_BUDGET > 0 && arena != &config.system.arena &&
+            arena->reserved + chunk_size > CONFIG_ZMK_KEYMAP_SHELL_ARENA_BUDGET) {
+            LOG_ERR("Slot memory budget exceeded (%d bytes)!", CONFIG_ZMK_KEYMAP_SHELL_ARENA_BUDGET);
+            return NULL;
+        }
+
+        chunk = heap_alloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        arena->reserved += chunk_size;
+    }
+
+    void* ptr = &chunk->data[chunk->used];
+    chunk->used += size;
+    return ptr;
+}
+
+static void arena_release(struct slot_arena* arena) {
+    struct arena_chunk* chunk = arena->head;
+    while (chunk != NULL) {
+        struct arena_chunk* next = chunk->next;
+        heap_free(chunk);
+        chunk = next;
+    }
+
+    arena->head = NULL;
+    arena->reserved = 0;
+}
+
+static uint32_t binding_key(const uint32_t layer, const uint16_t index) {
+    return (layer << 16) | index;
+}
+
+/* Position of the first binding at or after key in the sorted table. */
+static uint16_t binding_lower_bound(const struct keymap_slot* slot, const uint32_t key) {
+    uint16_t low = 0;
+    uint16_t high = slot->binding_count;
+    while (low < high) {
+        const uint16_t mid = low + (high - low) / 2;
+        if (binding_key(slot->bindings[mid].layer, slot->bindings[mid].index) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static struct layer_bindings slot_layer_bindings(const struct keymap_slot* slot, const uint8_t layer) {
+    const uint16_t start = binding_lower_bound(slot, binding_key(layer, 0));
+    const uint16_t end = binding_lower_bound(slot, binding_key(layer + 1, 0));
+    const struct layer_bindings layer_bindings = { .entries = &slot->bindings[start], .count = end - start };
+    return layer_bindings;
+}
+
+/* Grows the binding table to hold at least capacity entries; once sized, filling it allocates nothing. */
+static int slot_reserve_bindings(struct keymap_slot* slot, const size_t capacity) {
+    if (capacity <= slot->binding_capacity) {
+        return 0;
+    }
+    if (capacity > UINT16_MAX) {
+        return -ENOMEM;
+    }
+
+    struct binding_entry* bindings = arena_alloc(&slot->arena, capacity * sizeof(struct binding_entry));
+    if (bindings == NULL) {
+        return -ENOMEM;
+    }
+
+    if (slot->binding_count > 0) {
+        memcpy(bindings, slot->bindings, slot->binding_count * sizeof(struct binding_entry));
+    }
+    slot->bindings = bindings;
+    slot->binding_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Returns the entry for a binding, inserted in order if it is new (with data NULL). Bindings added
+ * in order are appended; the table doubles when full, so loading stays linear.
+ */
+static struct binding_entry* slot_put_binding(struct keymap_slot* slot, const uint8_t layer, const uint16_t index) {
+    const uint16_t pos = binding_lower_bound(slot, binding_key(layer, index));
+    if (pos < slot->binding_count && slot->bindings[pos].layer == layer && slot->bindings[pos].index == index) {
+        return &slot->bindings[pos];
+    }
+
+    if (slot->binding_count == slot->binding_capacity &&
+        slot_reserve_bindings(slot, slot->binding_capacity > 0 ? slot->binding_capacity * 2 : 16) != 0) {
+        return NULL;
+    }
+
+    struct binding_entry* entry = &slot->bindings[pos];
+    memmove(entry + 1, entry, (slot->binding_count - pos) * sizeof(*entry));
+    slot->binding_count++;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->layer = layer;
+    entry->index = index;
+    return entry;
+}
+
+static int slot_reserve_layer_names(struct keymap_slot* slot, const size_t capacity) {
+    if (capacity <= slot->name_capacity) {
+        return 0;
+    }
+    if (capacity > ZMK_KEYMAP_LAYERS_LEN) {
+        return -EINVAL;
+    }
+
+    struct layer_name* names = arena_alloc(&slot->arena, capacity * sizeof(struct layer_name));
+    if (names == NULL) {
+        return -ENOMEM;
+    }
+
+    if (slot->name_count > 0) {
+        memcpy(names, slot->names, slot->name_count * sizeof(struct layer_name));
+    }
+    slot->names = names;
+    slot->name_capacity = capacity;
+    return 0;
+}
+
+static const uint8_t* slot_layer_name_data(const struct keymap_slot* slot, const uint8_t layer, uint8_t* size) {
+    for (uint8_t i = 0; i < slot->name_count; i++) {
+        if (slot->names[i].layer == layer) {
+            *size = slot->names[i].length;
+            return slot->names[i].data;
+        }
+    }
+
+    *size = 0;
+    return NULL;
+}
+
+/* Returns the name entry of a layer, added in layer order if it is new (with data NULL). */
+static struct layer_name* slot_put_layer_name(struct keymap_slot* slot, const uint8_t layer) {
+    uint8_t pos = 0;
+    while (pos < slot->name_count && slot->names[pos].layer < layer) {
+        pos++;
+    }
+    if (pos < slot->name_count && slot->names[pos].layer == layer) {
+        return &slot->names[pos];
+    }
+
+    const uint8_t capacity = MIN(slot->name_capacity > 0 ? slot->name_capacity * 2 : 4, ZMK_KEYMAP_LAYERS_LEN);
+    if (slot->name_count == slot->name_capacity && slot_reserve_layer_names(slot, capacity) != 0) {
+        return NULL;
+    }
+
+    struct layer_name* name = &slot->names[pos];
+    memmove(name + 1, name, (slot->name_count - pos) * sizeof(*name));
+    slot->name_count++;
+
+    memset(name, 0, sizeof(*name));
+    name->layer = layer;
+    return name;
+}
+
 static int load_slot_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
     const struct cb_param* data = (struct cb_param*) param;
 
@@ -113,7 +717,7 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
             return -EIO;
         }
 
-        char* name_buffer = malloc(len + 1);
+        char* name_buffer = arena_alloc(&data->slot->arena, len + 1);
         if (name_buffer == NULL) {
             LOG_ERR("Failed to allocate memory for slot name!");
             return -ENOMEM;
@@ -122,27 +726,24 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
         const size_t size = read_cb(cb_arg, name_buffer, len);
         if (size != len) {
             LOG_ERR("Failed to read slot name!");
-            free(name_buffer);
             return -EIO;
         }
         
         name_buffer[len] = '\0';
-        if (data->slot->name != NULL) {
-            free((void*)data->slot->name);
-        }
         data->slot->name = name_buffer;
         data->slot->total_size += len;
     } else if (settings_name_steq(key, "layer_order", &next)) {
         shprint(data->sh, " > Found layers order (%d bytes)", len);
+        if (len > UINT8_MAX) {
+            LOG_ERR("Layer order too long (%d bytes)", (int)len);
+            return -EINVAL;
+        }
 
         data->slot->order_size = len;
         data->slot->total_size += len;
 
-        if (data->slot->order_data != NULL) {
-            free(data->slot->order_data);
-        }
-        data->slot->order_data = malloc(len);
-        if (data->slot->order_data == NULL && len > 0) {
+        data->slot->order_data = arena_alloc(&data->slot->arena, len);
+        if (data->slot->order_data == NULL) {
             LOG_ERR("Failed to allocate memory for layer order data!");
             return -ENOMEM;
         }
@@ -150,8 +751,8 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
         const size_t size = read_cb(cb_arg, data->slot->order_data, len);
         if (size != len) {
             LOG_ERR("Failed to read layer order data!");
-            free(data->slot->order_data);
             data->slot->order_data = NULL;
+            data->slot->order_size = 0;
         }
     } else if (settings_name_steq(key, "l_n", &next) && next) {
         const unsigned long layer_raw = strtoul(next, &endptr, 10);
@@ -164,25 +765,27 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
             return -EINVAL;
         }
         const uint8_t layer = (uint8_t)layer_raw;
-        data->slot->total_size += len;
-        data->slot->names_size[layer] = len;
+        if (len > UINT8_MAX) {
+            LOG_ERR("Name of layer %d too long (%d bytes)", layer, (int)len);
+            return -EINVAL;
+        }
 
         shprint(data->sh, " > Found name for layer %d (%d bytes)", layer, len);
 
-        if (data->slot->names_data[layer] != NULL) {
-            free(data->slot->names_data[layer]);
-        }
-        data->slot->names_data[layer] = malloc(len);
-        if (data->slot->names_data[layer] == NULL && len > 0) {
+        uint8_t* name_data = arena_alloc(&data->slot->arena, len);
+        struct layer_name* name = name_data != NULL ? slot_put_layer_name(data->slot, layer) : NULL;
+        if (name == NULL) {
             LOG_ERR("Failed to allocate memory for layer name data!");
             return -ENOMEM;
         }
 
-        const size_t size = read_cb(cb_arg, data->slot->names_data[layer], len);
+        const size_t size = read_cb(cb_arg, name_data, len);
         if (size != len) {
             LOG_ERR("Failed to read layer name!");
-            free(data->slot->names_data[layer]);
-            data->slot->names_data[layer] = NULL;
+        } else {
+            data->slot->total_size += len - name->length;
+            name->data = name_data;
+            name->length = len;
         }
     } else if (settings_name_steq(key, "l", &next) && next) {
         const unsigned long layer_raw = strtoul(next, &endptr, 10);
@@ -195,18 +798,20 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
             return -EINVAL;
         }
         const uint8_t layer = (uint8_t)layer_raw;
-        struct layer_bindings* layer_bindings = &data->slot->bindings[layer];
-        const uint16_t new_count = layer_bindings->count + 1;
-        struct binding_entry* new_entries = realloc(layer_bindings->entries, (size_t)new_count * sizeof(struct binding_entry));
-        if (new_entries == NULL && new_count > 0) {
-            LOG_ERR("Failed to reallocate entries array for layer %d!", layer);
-            return -ENOMEM;
-        }
 
-        layer_bindings->entries = new_entries;
+        const char *pos_start = endptr + 1;
+        const uint8_t pos = strtoul(pos_start, &endptr, 10);
+        if (endptr == pos_start) {
+            LOG_ERR("Invalid binding position in settings key");
+            return -EINVAL;
+        }
+        if (len > UINT8_MAX) {
+            LOG_ERR("Binding %d/%d too long (%d bytes)", layer, pos, (int)len);
+            return -EINVAL;
+        }
 
-        uint8_t* binding_data = malloc(len);
-        if (binding_data == NULL && len > 0) {
+        uint8_t* binding_data = arena_alloc(&data->slot->arena, len);
+        if (binding_data == NULL) {
             LOG_ERR("Failed to allocate memory for binding data!");
             return -ENOMEM;
         }
@@ -214,22 +819,18 @@ static int load_slot_cb(const char *key, const size_t len, const settings_read_c
         const size_t size = read_cb(cb_arg, binding_data, len);
         if (size != len) {
             LOG_ERR("Failed to read layer bindings!");
-            free(binding_data);
             return -EIO;
         }
 
-        const char *pos_start = endptr + 1;
-        const uint8_t pos = strtoul(pos_start, &endptr, 10);
-        if (endptr == pos_start) {
-            LOG_ERR("Invalid binding position in settings key");
-            free(binding_data);
-            return -EINVAL;
+        struct binding_entry* entry = slot_put_binding(data->slot, layer, pos);
+        if (entry == NULL) {
+            LOG_ERR("Failed to grow the binding table for layer %d!", layer);
+            return -ENOMEM;
         }
-        layer_bindings->entries[layer_bindings->count].index = pos;
-        layer_bindings->entries[layer_bindings->count].length = len;
-        layer_bindings->entries[layer_bindings->count].data = binding_data;
-        layer_bindings->count = new_count;
-        data->slot->total_size += len;
+
+        data->slot->total_size += len - entry->length;
+        entry->length = len;
+        entry->data = binding_data;
 
         shprint(data->sh, " > Found binding for layer %d (%d bytes)", layer, len);
     }
@@ -253,177 +854,2772 @@ static void free_slot(struct keymap_slot* slot) {
         return;
     }
 
-    if (slot->name != NULL) {
-        free((void*)slot->name);
-        slot->name = NULL;
+    arena_release(&slot->arena);
+    memset(slot, 0, sizeof(*slot));
+    slot->is_free = true;
+}
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t* data, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
     }
+    return hash;
+}
 
-    if (slot->order_data != NULL) {
-        free(slot->order_data);
-        slot->order_data = NULL;
+static uint32_t record_hash(const uint8_t tag, const uint8_t layer, const uint16_t index,
+                            const uint8_t* data, const size_t len) {
+    const uint8_t head[] = { tag, layer, index & 0xFF, index >> 8 };
+    uint32_t hash = fnv1a(FNV_OFFSET_BASIS, head, sizeof(head));
+    hash = fnv1a(hash, data, len);
+
+    /* Avalanche before summing, so records differing in a few bits can't cancel each other out. */
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BU;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Records are summed, so the result doesn't depend on the order settings handed them to us. */
+static uint32_t slot_fingerprint(const struct keymap_slot* slot) {
+    uint32_t fingerprint = 0;
+    if (slot->order_size > 0) {
+        fingerprint += record_hash('o', 0, 0, slot->order_data, slot->order_size);
     }
 
-    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
-        if (slot->names_data[i] != NULL) {
-            free(slot->names_data[i]);
-            slot->names_data[i] = NULL;
+    for (uint8_t i = 0; i < slot->name_count; i++) {
+        const struct layer_name* name = &slot->names[i];
+        if (name->length > 0) {
+            fingerprint += record_hash('n', name->layer, 0, name->data, name->length);
         }
-        slot->names_size[i] = 0;
     }
 
-    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
-        struct layer_bindings* layer_bindings = &slot->bindings[i];
-        if (layer_bindings->entries != NULL) {
-            for (uint16_t j = 0; j < layer_bindings->count; j++) {
-                if (layer_bindings->entries[j].data != NULL) {
-                    free(layer_bindings->entries[j].data);
-                }
-            }
-            free(layer_bindings->entries);
-            layer_bindings->entries = NULL;
-        }
-        layer_bindings->count = 0;
+    for (uint16_t i = 0; i < slot->binding_count; i++) {
+        const struct binding_entry* entry = &slot->bindings[i];
+        fingerprint += record_hash('b', entry->layer, entry->index, entry->data, entry->length);
     }
 
-    slot->order_size = 0;
-    slot->total_size = 0;
-    slot->is_free = true;
+    return fingerprint;
+}
 
-#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-    slot->has_bistable = false;
-    slot->bistable_slot = 0;
-#endif
+static void cache_evict(struct payload_cache_entry* entry) {
+    free_slot(&entry->slot);
+    entry->slot_idx = -1;
 }
 
-static void free_all_slots(void) {
+/* Forgets the decoded copy of a slot whose stored contents changed. */
+static void cache_drop(const uint8_t slot_idx) {
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        if (config.cache.entries[i].slot_idx == slot_idx) {
+            cache_evict(&config.cache.entries[i]);
+        }
+    }
+}
+
+static void cache_clear(void) {
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        cache_evict(&config.cache.entries[i]);
+    }
+}
+
+static size_t cache_usage(void) {
+    size_t bytes = 0;
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        if (config.cache.entries[i].slot_idx >= 0) {
+            bytes += config.cache.entries[i].slot.arena.reserved;
+        }
+    }
+    return bytes;
+}
+
+static struct payload_cache_entry* cache_lru(const struct payload_cache_entry* keep) {
+    struct payload_cache_entry* lru = NULL;
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        struct payload_cache_entry* entry = &config.cache.entries[i];
+        if (entry != keep && entry->slot_idx >= 0 && entry->slot_idx != config.cache.pinned &&
+            (lru == NULL || entry->last_used < lru->last_used)) {
+            lru = entry;
+        }
+    }
+    return lru;
+}
+
+/* Evicts least recently used slots other than keep until the cache fits its budget. */
+static void cache_trim(const struct payload_cache_entry* keep) {
+    while (cache_usage() > CONFIG_ZMK_KEYMAP_SHELL_CACHE_BYTES) {
+        struct payload_cache_entry* lru = cache_lru(keep);
+        if (lru == NULL) {
+            break;
+        }
+
+        cache_evict(lru);
+        config.cache.evictions++;
+    }
+}
+
+static void forget_slots(void) {
     free_slot(&config.system);
     for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
-        free_slot(&config.slots[i]);
+        slot_meta_reset(&config.slots[i]);
     }
 
+    config.next_id = 1;
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    config.shared_count = 0;
+#endif
     config.initialized = false;
 }
 
-static int keymap_shell_init(void) {
-    memset(&config.system, 0, sizeof(config.system));
-    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
-        memset(&config.slots[i], 0, sizeof(config.slots[i]));
+static void free_all_slots(void) {
+    forget_slots();
+    cache_clear();
+}
+
+/* After re-reading metadata, keeps only cached slots whose stored copy still has the same fingerprint. */
+static void cache_revalidate(void) {
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        struct payload_cache_entry* entry = &config.cache.entries[i];
+        if (entry->slot_idx < 0) {
+            continue;
+        }
+
+        const struct slot_meta* meta = &config.slots[entry->slot_idx];
+        if (meta->is_free || meta->legacy || meta->fingerprint != entry->slot.fingerprint) {
+            cache_evict(entry);
+        }
+    }
+}
+
+struct blob_writer {
+    uint8_t* buf;
+    size_t pos;
+};
+
+static void blob_put(struct blob_writer* writer, const void* data, const size_t len) {
+    if (writer->buf != NULL && len > 0) {
+        memcpy(&writer->buf[writer->pos], data, len);
+    }
+    writer->pos += len;
+}
+
+static void blob_put_bindings(struct blob_writer* writer, const struct layer_bindings* layer_bindings) {
+    for (uint16_t j = 0; j < layer_bindings->count; j++) {
+        const struct binding_entry* entry = &layer_bindings->entries[j];
+        const struct slot_blob_binding binding = { .index = entry->index, .length = entry->length };
+        blob_put(writer, &binding, sizeof(binding));
+        blob_put(writer, entry->data, entry->length);
+    }
+}
+
+#define SHARED_PLAN_INLINE UINT8_MAX
+
+/* Which layers keep their bindings in shared records, and which records those are. */
+struct shared_plan {
+    uint8_t count;
+    struct shared_ref refs[ZMK_KEYMAP_LAYERS_LEN];
+    uint8_t layer_ref[ZMK_KEYMAP_LAYERS_LEN];
+};
+
+/*
+ * Serializes a slot; with out == NULL only the resulting size is computed. Layers the plan marks as
+ * shared are stored as references, all others (or all, without a plan) inline.
+ */
+static size_t slot_blob_encode(const struct keymap_slot* slot, const char* name, const uint16_t id,
+                               const uint8_t flags, const uint8_t bistable_slot,
+                               const struct shared_plan* plan, uint8_t* out) {
+    struct blob_writer writer = { .buf = out, .pos = sizeof(struct slot_blob_header) };
+    const bool shared = plan != NULL && plan->count > 0;
+
+    const size_t name_len = strlen(name);
+    blob_put(&writer, name, name_len);
+    if (shared) {
+        blob_put(&writer, &plan->count, sizeof(plan->count));
+        blob_put(&writer, plan->refs, plan->count * sizeof(struct shared_ref));
+    }
+    blob_put(&writer, slot->order_data, slot->order_size);
+
+    uint8_t layer_count = 0;
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        const struct layer_bindings layer_bindings = slot_layer_bindings(slot, i);
+        uint8_t name_size;
+        const uint8_t* layer_name = slot_layer_name_data(slot, i, &name_size);
+        if (name_size == 0 && layer_bindings.count == 0) {
+            continue;
+        }
+
+        const bool layer_shared = shared && plan->layer_ref[i] != SHARED_PLAN_INLINE;
+        const struct slot_blob_layer layer = {
+            .layer = i,
+            .name_len = name_size,
+            .count = layer_shared ? SLOT_BLOB_SHARED_LAYER : layer_bindings.count,
+        };
+        blob_put(&writer, &layer, sizeof(layer));
+        blob_put(&writer, layer_name, name_size);
+
+        if (layer_shared) {
+            blob_put(&writer, &plan->layer_ref[i], sizeof(plan->layer_ref[i]));
+        } else {
+            blob_put_bindings(&writer, &layer_bindings);
+        }
+        layer_count++;
+    }
+
+    if (out != NULL) {
+        const size_t body = sizeof(struct slot_blob_header);
+        const struct slot_blob_header header = {
+            .magic = SLOT_BLOB_MAGIC,
+            .version = SLOT_BLOB_VERSION,
+            .flags = flags | (shared ? SLOT_BLOB_F_SHARED : 0),
+            .size = writer.pos,
+            .crc = crc32_ieee(&out[body], writer.pos - body),
+            .name_len = name_len,
+            .order_len = slot->order_size,
+            .layer_count = layer_count,
+            .bistable_slot = bistable_slot,
+            .fingerprint = slot->fingerprint,
+            .id = id,
+        };
+        memcpy(out, &header, sizeof(header));
+    }
+
+    return writer.pos;
+}
+
+struct blob_reader {
+    const uint8_t* buf;
+    size_t size;
+    size_t pos;
+};
+
+static const uint8_t* blob_take(struct blob_reader* reader, const size_t len) {
+    if (reader->size - reader->pos < len) {
+        return NULL;
+    }
+
+    const uint8_t* ptr = &reader->buf[reader->pos];
+    reader->pos += len;
+    return ptr;
+}
+
+/* Reads and checks a header. Returns its size. */
+static int slot_blob_read_header(struct slot_blob_header* header, const uint8_t* data, const size_t len) {
+    if (len < sizeof(*header)) {
+        return -EINVAL;
+    }
+
+    memcpy(header, data, sizeof(*header));
+    if (header->magic != SLOT_BLOB_MAGIC || header->version != SLOT_BLOB_VERSION) {
+        return -EINVAL;
+    }
+
+    return sizeof(*header);
+}
+
+static int decode_bindings(struct keymap_slot* slot, const uint8_t layer, struct blob_reader* reader,
+                           const uint16_t count, const bool store) {
+    for (uint16_t j = 0; j < count; j++) {
+        const uint8_t* raw = blob_take(reader, sizeof(struct slot_blob_binding));
+        if (raw == NULL) {
+            return -EINVAL;
+        }
+
+        struct slot_blob_binding binding;
+        memcpy(&binding, raw, sizeof(binding));
+        const uint8_t* data = blob_take(reader, binding.length);
+        if (data == NULL) {
+            return -EINVAL;
+        }
+
+        if (!store) {
+            continue;
+        }
+
+        struct binding_entry* entry = slot_put_binding(slot, layer, binding.index);
+        if (entry == NULL) {
+            return -ENOMEM;
+        }
+        slot->total_size += binding.length - entry->length;
+        entry->length = binding.length;
+        entry->data = (uint8_t*)data;
     }
 
     return 0;
 }
 
-static void load_system(const struct shell *sh) {
-    free_all_slots();
-    shprint(sh, "Reading system keymap...");
+static void shared_key(char* key, const size_t size, const struct shared_ref* ref) {
+    snprintf(key, size, SHARED_LAYER_TREE "/%08x%08x", ref->crc, ref->hash);
+}
+
+struct shared_layer_data {
+    const uint8_t* data;
+    uint16_t size;
+};
+
+struct shared_load_param {
+    struct keymap_slot* slot;
+    const struct shared_ref* refs;
+    uint8_t count;
+    struct shared_layer_data* layers;
+};
+
+static int load_shared_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    struct shared_load_param* load = param;
+
+    char name[sizeof(SHARED_LAYER_TREE) + 17];
+    for (uint8_t i = 0; i < load->count; i++) {
+        shared_key(name, sizeof(name), &load->refs[i]);
+        if (strcmp(key, &name[sizeof(SHARED_LAYER_TREE)]) != 0 || load->layers[i].data != NULL) {
+            continue;
+        }
+
+        uint8_t* data = len <= UINT16_MAX ? arena_alloc(&load->slot->arena, len) : NULL;
+        if (data == NULL) {
+            return -ENOMEM;
+        }
+        if (read_cb(cb_arg, data, len) != len) {
+            return -EIO;
+        }
+
+        load->layers[i].data = data;
+        load->layers[i].size = len;
+    }
+    return 0;
+}
+
+/* Takes the shared layers read along with the slot's fragments; false if any of refs is missing. */
+static bool take_preloaded_layers(const struct shared_load_param* preload, const struct shared_ref* refs,
+                                  const uint8_t count, struct shared_layer_data* layers) {
+    for (uint8_t i = 0; i < count; i++) {
+        const struct shared_ref ref = refs[i];
+        uint8_t j = 0;
+        while (j < preload->count &&
+               (preload->refs[j].crc != ref.crc || preload->refs[j].hash != ref.hash || preload->layers[j].data == NULL)) {
+            j++;
+        }
+        if (j == preload->count) {
+            return false;
+        }
+        layers[i] = preload->layers[j];
+    }
+    return true;
+}
+
+/*
+ * Gets the shared layers a slot refers to, checking each against its reference: from those read with
+ * its fragments when they are all there, otherwise in one walk of their own.
+ */
+static int load_shared_layers(struct keymap_slot* slot, const struct shared_ref* refs, const uint8_t count,
+                              struct shared_layer_data* layers) {
+    if (slot->shared_preload == NULL || !take_preloaded_layers(slot->shared_preload, refs, count, layers)) {
+        memset(layers, 0, count * sizeof(*layers));
+        struct shared_load_param load = { .slot = slot, .refs = refs, .count = count, .layers = layers };
+        const int err = storage_walk(SHARED_LAYER_TREE, load_shared_cb, &load);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (layers[i].data == NULL) {
+            LOG_ERR("Shared layer %08x%08x is missing", refs[i].crc, refs[i].hash);
+            return -ENOENT;
+        }
+
+        const struct shared_ref ref = refs[i];
+        if (crc32_ieee(layers[i].data, layers[i].size) != ref.crc) {
+            return -EILSEQ;
+        }
+    }
+    return 0;
+}
 
-    struct cb_param data = { .sh = sh, .slot = &config.system };
-    int err = settings_load_subtree_direct("keymap", load_slot_cb, &data);
+/*
+ * Reads the layer records of a blob. With store false they are only checked and their bindings and
+ * names counted, otherwise added to the slot.
+ */
+static int decode_layers(struct keymap_slot* slot, struct blob_reader reader, const uint8_t layer_count,
+                         const struct shared_layer_data* shared, const uint8_t shared_count, const bool store,
+                         size_t* bindings, size_t* names) {
+    for (uint8_t i = 0; i < layer_count; i++) {
+        const uint8_t* raw = blob_take(&reader, sizeof(struct slot_blob_layer));
+        if (raw == NULL) {
+            return -EINVAL;
+        }
+
+        struct slot_blob_layer layer;
+        memcpy(&layer, raw, sizeof(layer));
+        if (layer.layer >= ZMK_KEYMAP_LAYERS_LEN) {
+            return -EINVAL;
+        }
+
+        const uint8_t* layer_name = blob_take(&reader, layer.name_len);
+        if (layer_name == NULL) {
+            return -EINVAL;
+        }
+
+        if (layer.name_len > 0 && !store) {
+            (*names)++;
+        } else if (layer.name_len > 0) {
+            struct layer_name* name = slot_put_layer_name(slot, layer.layer);
+            if (name == NULL) {
+                return -ENOMEM;
+            }
+            slot->total_size += layer.name_len - name->length;
+            name->data = (uint8_t*)layer_name;
+            name->length = layer.name_len;
+        }
+
+        struct blob_reader bindings_reader = reader;
+        uint16_t count = layer.count;
+        if (layer.count == SLOT_BLOB_SHARED_LAYER) {
+            const uint8_t* ref = blob_take(&reader, sizeof(uint8_t));
+            if (ref == NULL || *ref >= shared_count) {
+                return -EINVAL;
+            }
+
+            const struct blob_reader shared_reader = { .buf = shared[*ref].data, .size = shared[*ref].size, .pos = 0 };
+            bindings_reader = shared_reader;
+            const uint8_t* raw_count = blob_take(&bindings_reader, sizeof(count));
+            if (raw_count == NULL) {
+                return -EINVAL;
+            }
+            memcpy(&count, raw_count, sizeof(count));
+        }
+
+        *bindings += count;
+        const int err = decode_bindings(slot, layer.layer, &bindings_reader, count, store);
+        if (err != 0) {
+            return err;
+        }
+        if (layer.count != SLOT_BLOB_SHARED_LAYER) {
+            reader = bindings_reader;
+        }
+    }
+
+    return 0;
+}
+
+/* Decodes a packed slot in place: names and bindings point into the blob, which must outlive the slot. */
+static int slot_blob_decode(struct keymap_slot* slot, const uint8_t* blob, const size_t size) {
+    struct slot_blob_header header;
+    const int header_size = slot_blob_read_header(&header, blob, size);
+    if (header_size < 0 || header.size != size) {
+        return -EINVAL;
+    }
+
+    struct blob_reader reader = { .buf = blob, .size = size, .pos = header_size };
+    if (crc32_ieee(&blob[reader.pos], size - reader.pos) != header.crc) {
+        return -EILSEQ;
+    }
+
+    const uint8_t* name = blob_take(&reader, header.name_len);
+    if (name == NULL) {
+        return -EINVAL;
+    }
+
+    /* With shared layers, their reference table sits between the name and the order. */
+    struct shared_layer_data shared[ZMK_KEYMAP_LAYERS_LEN];
+    uint8_t shared_count = 0;
+    const uint8_t* refs = NULL;
+    if (header.flags & SLOT_BLOB_F_SHARED) {
+        const uint8_t* raw_count = blob_take(&reader, sizeof(shared_count));
+        if (raw_count == NULL || *raw_count > ZMK_KEYMAP_LAYERS_LEN) {
+            return -EINVAL;
+        }
+
+        shared_count = *raw_count;
+        refs = blob_take(&reader, shared_count * sizeof(struct shared_ref));
+        if (refs == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    const uint8_t* order = blob_take(&reader, header.order_len);
+    char* name_buffer = arena_alloc(&slot->arena, header.name_len + 1);
+    if (order == NULL || name_buffer == NULL) {
+        return name_buffer == NULL ? -ENOMEM : -EINVAL;
+    }
+
+    if (shared_count > 0) {
+        const int err = load_shared_layers(slot, (const struct shared_ref*)refs, shared_count, shared);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    memcpy(name_buffer, name, header.name_len);
+    name_buffer[header.name_len] = '\0';
+    slot->name = name_buffer;
+    slot->order_data = header.order_len > 0 ? (uint8_t*)order : NULL;
+    slot->order_size = header.order_len;
+    slot->total_size = header.name_len + header.order_len;
+
+    /* Count first, so the binding and name tables are allocated once, at their final size. */
+    size_t binding_total = 0;
+    size_t name_total = 0;
+    int err = decode_layers(slot, reader, header.layer_count, shared, shared_count, false, &binding_total, &name_total);
+    if (err == 0) {
+        err = slot_reserve_bindings(slot, binding_total);
+    }
+    if (err == 0) {
+        err = slot_reserve_layer_names(slot, name_total);
+    }
+    if (err == 0) {
+        err = decode_layers(slot, reader, header.layer_count, shared, shared_count, true, &binding_total, &name_total);
+    }
     if (err != 0) {
-        LOG_ERR("Failed to load system subtree for keymap: %d", err);
+        return err;
     }
-    config.system.is_free = config.system.total_size == 0;
+
 #if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-    config.system.is_free = config.system.is_free && zbs_get_slot() == ZBS_DEFAULT_SLOT;
+    if (header.flags & SLOT_BLOB_F_BISTABLE) {
+        slot->has_bistable = true;
+        slot->bistable_slot = header.bistable_slot;
+        slot->total_size += sizeof(header.bistable_slot);
+    }
 #endif
 
-    shprint(sh, "");
-    shprint(sh, "Reading slots...");
-    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
-        char key[24];
-        snprintf(key, sizeof(key), "slots/%d", i);
-        data.slot = &config.slots[i];
-        err = settings_load_subtree_direct(key, load_slot_cb, &data);
-        if (err != 0) {
-            LOG_ERR("Failed to load slot %d", i);
+    slot->fingerprint = header.fingerprint;
+    slot->is_free = false;
+    return 0;
+}
+
+static int parse_chunk_index(const char* key, const size_t len) {
+    char* endptr;
+    const unsigned long index = strtoul(key, &endptr, 10);
+    if (endptr == key || *endptr != '\0' || index > UINT8_MAX || len > UINT16_MAX) {
+        return -EINVAL;
+    }
+    return index;
+}
+
+static int load_fragment_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    struct keymap_slot* slot = (struct keymap_slot*) param;
+
+    const int index = parse_chunk_index(key, len);
+    if (index < 0) {
+        return index;
+    }
+
+    struct blob_fragment* fragment = arena_alloc(&slot->arena, sizeof(struct blob_fragment) + len);
+    if (fragment == NULL) {
+        LOG_ERR("Failed to allocate memory for slot data!");
+        return -ENOMEM;
+    }
+
+    if (read_cb(cb_arg, fragment->data, len) != len) {
+        LOG_ERR("Failed to read slot data!");
+        return -EIO;
+    }
+
+    fragment->index = index;
+    fragment->length = len;
+    fragment->next = slot->fragments;
+    slot->fragments = fragment;
+    return 0;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+/* A slot's fragments and the shared layers it refers to, gathered in a single walk of "slots". */
+struct payload_load_param {
+    struct keymap_slot* slot;
+    uint8_t slot_idx;
+    struct shared_load_param shared;
+};
+
+static int load_payload_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    struct payload_load_param* load = param;
+
+    const char *next;
+    if (settings_name_steq(key, "s", &next) && next) {
+        return load_shared_cb(next, len, read_cb, cb_arg, &load->shared);
+    }
+
+    char *endptr;
+    const unsigned long slot_idx = strtoul(key, &endptr, 10);
+    if (endptr == key || *endptr != '/' || slot_idx != load->slot_idx) {
+        return 0;
+    }
+    if (settings_name_steq(endptr + 1, "p", &next) && next) {
+        return load_fragment_cb(next, len, read_cb, cb_arg, load->slot);
+    }
+    return 0;
+}
+#endif
+
+static const struct blob_fragment* find_fragment(const struct blob_fragment* fragments, const uint16_t index) {
+    for (const struct blob_fragment* it = fragments; it != NULL; it = it->next) {
+        if (it->index == index) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+/* Reads the fragments of a packed slot in index order, without joining them first. */
+struct fragment_stream {
+    const struct blob_fragment* fragments;
+    const struct blob_fragment* current;
+    uint16_t index;
+    uint16_t offset;
+};
+
+/* Points data at the next contiguous run of at most max bytes and returns its length, 0 at the end. */
+static size_t fragment_stream_next(struct fragment_stream* stream, const uint8_t** data, const size_t max) {
+    if (stream->current != NULL && stream->offset == stream->current->length) {
+        stream->current = NULL;
+        stream->index++;
+    }
+    if (stream->current == NULL) {
+        stream->current = find_fragment(stream->fragments, stream->index);
+        stream->offset = 0;
+        if (stream->current == NULL) {
+            return 0;
         }
+    }
 
-        data.slot->is_free = data.slot->total_size == 0;
+    const size_t len = MIN(max, stream->current->length - stream->offset);
+    *data = &stream->current->data[stream->offset];
+    stream->offset += len;
+    return len;
+}
+
+static size_t fragment_stream_read(struct fragment_stream* stream, uint8_t* buf, const size_t len) {
+    size_t done = 0;
+    const uint8_t* data;
+    size_t run;
+    while (done < len && (run = fragment_stream_next(stream, &data, len - done)) > 0) {
+        memcpy(&buf[done], data, run);
+        done += run;
     }
+    return done;
+}
 
-    config.initialized = true;
-    shprint(sh, "");
+/*
+ * LZSS: a flag byte precedes every eight items, a set bit marking a literal byte and a clear one a
+ * 16-bit match token. Binding records repeat their length, behavior and parameter bytes a lot, so
+ * short matches over a small window are what pays off.
+ */
+#define LZ_OFFSET_BITS 10
+#define LZ_WINDOW BIT(LZ_OFFSET_BITS)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + BIT(16 - LZ_OFFSET_BITS) - 1)
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_COMPRESS)
+/* Returns the compressed size, or 0 if it wouldn't fit max bytes. */
+static size_t lz_compress(const uint8_t* in, const size_t len, uint8_t* out, const size_t max) {
+    size_t pos = 0;
+    size_t written = 0;
+    while (pos < len) {
+        if (written + 1 + 8 * sizeof(uint16_t) > max) {
+            return 0;
+        }
+
+        const size_t flags_pos = written++;
+        uint8_t flags = 0;
+        for (int bit = 0; bit < 8 && pos < len; bit++) {
+            size_t best_len = 0;
+            size_t best_offset = 0;
+            const size_t limit = MIN(LZ_MAX_MATCH, len - pos);
+            for (size_t from = pos > LZ_WINDOW ? pos - LZ_WINDOW : 0; from < pos; from++) {
+                size_t match = 0;
+                while (match < limit && in[from + match] == in[pos + match]) {
+                    match++;
+                }
+                if (match > best_len) {
+                    best_len = match;
+                    best_offset = pos - from;
+                }
+            }
+
+            if (best_len >= LZ_MIN_MATCH) {
+                const uint16_t token = (best_offset - 1) | ((best_len - LZ_MIN_MATCH) << LZ_OFFSET_BITS);
+                out[written++] = token & 0xFF;
+                out[written++] = token >> 8;
+                pos += best_len;
+            } else {
+                flags |= BIT(bit);
+                out[written++] = in[pos++];
+            }
+        }
+        out[flags_pos] = flags;
+    }
+    return written;
 }
+#endif
 
-SYS_INIT(keymap_shell_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+/* Decoder state, carried across stored records; matches copy from what was already decoded. */
+struct lz_decoder {
+    uint8_t* out;
+    size_t size;
+    size_t pos;
+    uint8_t flags;
+    uint8_t items;
+    int16_t token_low;
+};
+
+static int lz_feed(struct lz_decoder* lz, const uint8_t* data, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (lz->items == 0) {
+            lz->flags = data[i];
+            lz->items = 8;
+            continue;
+        }
+
+        if (lz->flags & BIT(0)) {
+            if (lz->pos >= lz->size) {
+                return -EINVAL;
+            }
+            lz->out[lz->pos++] = data[i];
+        } else if (lz->token_low < 0) {
+            lz->token_low = data[i];
+            continue;
+        } else {
+            const uint16_t token = lz->token_low | (data[i] << 8);
+            const size_t offset = (token & (LZ_WINDOW - 1)) + 1;
+            const size_t length = (token >> LZ_OFFSET_BITS) + LZ_MIN_MATCH;
+            if (offset > lz->pos || length > lz->size - lz->pos) {
+                return -EINVAL;
+            }
+            for (size_t j = 0; j < length; j++, lz->pos++) {
+                lz->out[lz->pos] = lz->out[lz->pos - offset];
+            }
+            lz->token_low = -1;
+        }
+
+        lz->flags >>= 1;
+        lz->items--;
+    }
+    return 0;
+}
+
+/* Size of the uncompressed start of a blob: header, name and shared layer references, if all in data. */
+static int slot_blob_head_size(const struct slot_blob_header* header, const int header_size,
+                               const uint8_t* data, const size_t len) {
+    size_t size = header_size + header->name_len;
+    if (header->flags & SLOT_BLOB_F_SHARED) {
+        if (len <= size || data[size] > ZMK_KEYMAP_LAYERS_LEN) {
+            return -EINVAL;
+        }
+        size += 1 + data[size] * sizeof(struct shared_ref);
+    }
+    return size <= len ? (int)size : -EINVAL;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_COMPRESS)
+/*
+ * Compresses the order and layers of a packed slot into a new blob from the scratch arena. Returns
+ * its size, or 0 when compressing doesn't make it smaller.
+ */
+static size_t slot_blob_compress(const uint8_t* blob, const size_t size, struct slot_arena* scratch, uint8_t** out) {
+    struct slot_blob_header header;
+    const int header_size = slot_blob_read_header(&header, blob, size);
+    const int head = header_size < 0 ? header_size : slot_blob_head_size(&header, header_size, blob, size);
+    if (head < 0 || size < (size_t)head + sizeof(uint16_t) + LZ_MIN_MATCH) {
+        return 0;
+    }
+
+    uint8_t* packed = arena_alloc(scratch, size);
+    if (packed == NULL) {
+        return 0;
+    }
+
+    const uint16_t raw = size - head;
+    memcpy(packed, blob, head);
+    memcpy(&packed[head], &raw, sizeof(raw));
+    const size_t body = head + sizeof(raw);
+    const size_t compressed = lz_compress(&blob[head], raw, &packed[body], size - body - 1);
+    if (compressed == 0) {
+        return 0;
+    }
+
+    header.flags |= SLOT_BLOB_F_COMPRESSED;
+    header.size = body + compressed;
+    header.crc = crc32_ieee(&packed[header_size], header.size - header_size);
+    memcpy(packed, &header, header_size);
+    *out = packed;
+    return header.size;
+}
+#endif
+
+/*
+ * Decompresses a packed slot record by record into a single buffer, then decodes it. The dictionary
+ * is the decompressed output itself, so no other scratch memory is needed.
+ */
+static int inflate_slot_blob(struct keymap_slot* slot) {
+    struct fragment_stream stream = { .fragments = slot->fragments };
+    uint8_t head[SLOT_BLOB_HEAD_MAX];
+
+    struct slot_blob_header header;
+    size_t head_size = sizeof(header);
+    if (fragment_stream_read(&stream, head, head_size) != head_size) {
+        return -EINVAL;
+    }
+    memcpy(&header, head, sizeof(header));
+    if (header.magic != SLOT_BLOB_MAGIC || header.version != SLOT_BLOB_VERSION || header.name_len >= CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX) {
+        return -EINVAL;
+    }
+
+    size_t part = header.name_len + ((header.flags & SLOT_BLOB_F_SHARED) ? 1 : 0);
+    if (fragment_stream_read(&stream, &head[head_size], part) != part) {
+        return -EINVAL;
+    }
+    head_size += part;
+    if (header.flags & SLOT_BLOB_F_SHARED) {
+        const uint8_t shared_count = head[head_size - 1];
+        part = shared_count * sizeof(struct shared_ref);
+        if (shared_count > ZMK_KEYMAP_LAYERS_LEN || fragment_stream_read(&stream, &head[head_size], part) != part) {
+            return -EINVAL;
+        }
+        head_size += part;
+    }
+
+    uint16_t raw;
+    if (fragment_stream_read(&stream, (uint8_t*)&raw, sizeof(raw)) != sizeof(raw)) {
+        return -EINVAL;
+    }
+
+    const size_t size = head_size + raw;
+    uint8_t* blob = size <= UINT16_MAX ? arena_alloc(&slot->arena, size) : NULL;
+    if (blob == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(blob, head, head_size);
+
+    uint32_t crc = crc32_ieee(&head[sizeof(header)], head_size - sizeof(header));
+    crc = crc32_ieee_update(crc, (const uint8_t*)&raw, sizeof(raw));
+    size_t stored = head_size + sizeof(raw);
+
+    struct lz_decoder lz = { .out = blob, .size = size, .pos = head_size, .token_low = -1 };
+    const uint8_t* data;
+    size_t len;
+    while (stored < header.size && (len = fragment_stream_next(&stream, &data, header.size - stored)) > 0) {
+        crc = crc32_ieee_update(crc, data, len);
+        stored += len;
+        const int err = lz_feed(&lz, data, len);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    if (stored != header.size || crc != header.crc) {
+        return -EILSEQ;
+    }
+    if (lz.pos != size || lz.token_low >= 0) {
+        return -EINVAL;
+    }
+
+    /* From here on it is an ordinary uncompressed blob. */
+    header.flags &= ~SLOT_BLOB_F_COMPRESSED;
+    header.size = size;
+    header.crc = crc32_ieee(&blob[sizeof(header)], size - sizeof(header));
+    memcpy(blob, &header, sizeof(header));
+    return slot_blob_decode(slot, blob, size);
+}
+
+/* Joins the fragments of a packed slot in index order and decodes them. */
+static int assemble_slot_blob(struct keymap_slot* slot) {
+    const struct blob_fragment* first = find_fragment(slot->fragments, 0);
+
+    struct slot_blob_header header;
+    if (first == NULL || first->length < sizeof(header)) {
+        return -EINVAL;
+    }
+    memcpy(&header, first->data, sizeof(header));
+    if (header.flags & SLOT_BLOB_F_COMPRESSED) {
+        return inflate_slot_blob(slot);
+    }
+    if (first->length == header.size) {
+        /* Stored in a single record: decode it where it is. */
+        return slot_blob_decode(slot, first->data, header.size);
+    }
+
+    uint8_t* blob = arena_alloc(&slot->arena, header.size);
+    if (blob == NULL) {
+        return -ENOMEM;
+    }
+
+    size_t collected = 0;
+    for (uint16_t index = 0; collected < header.size; index++) {
+        const struct blob_fragment* fragment = find_fragment(slot->fragments, index);
+        if (fragment == NULL || fragment->length > header.size - collected) {
+            return -EINVAL;
+        }
+
+        memcpy(&blob[collected], fragment->data, fragment->length);
+        collected += fragment->length;
+    }
+
+    return slot_blob_decode(slot, blob, header.size);
+}
+
+/*
+ * Fills in slot metadata from the start of a packed slot: the header and, if present, the name and
+ * shared layer references.
+ */
+static int slot_meta_parse(struct slot_meta* meta, const uint8_t* data, const size_t len) {
+    struct slot_blob_header header;
+    const int header_size = slot_blob_read_header(&header, data, len);
+    if (header_size < 0) {
+        return header_size;
+    }
+
+    const size_t name_len = MIN(MIN(header.name_len, len - header_size), sizeof(meta->name) - 1);
+    memcpy(meta->name, &data[header_size], name_len);
+    meta->name[name_len] = '\0';
+
+    meta->id = header.id;
+    meta->size = header.size;
+    meta->raw_size = header.size;
+    if (header.flags & SLOT_BLOB_F_COMPRESSED) {
+        const int head = slot_blob_head_size(&header, header_size, data, len);
+        uint16_t raw;
+        meta->raw_size = 0;
+        if (head >= 0 && len >= (size_t)head + sizeof(raw)) {
+            memcpy(&raw, &data[head], sizeof(raw));
+            meta->raw_size = head + raw;
+        }
+    }
+    meta->fingerprint = header.fingerprint;
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    meta->has_bistable = header.flags & SLOT_BLOB_F_BISTABLE;
+    meta->bistable_slot = header.bistable_slot;
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    slot_meta_release_shared(meta);
+    if (header.flags & SLOT_BLOB_F_SHARED) {
+        const size_t refs = header_size + header.name_len;
+        const uint8_t count = len > refs ? data[refs] : SHARED_REFS_UNKNOWN;
+        meta->shared_count = SHARED_REFS_UNKNOWN;
+        if (count <= ZMK_KEYMAP_LAYERS_LEN && len >= refs + 1 + count * sizeof(struct shared_ref)) {
+            meta->shared = count > 0 ? heap_alloc(count * sizeof(struct shared_ref)) : NULL;
+            if (meta->shared != NULL) {
+                memcpy(meta->shared, &data[refs + 1], count * sizeof(struct shared_ref));
+            }
+            if (count == 0 || meta->shared != NULL) {
+                meta->shared_count = count;
+            }
+        }
+    }
+#endif
+
+    meta->is_free = false;
+    return 0;
+}
+
+static int load_legacy_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    const char *next;
+    if (settings_name_steq(key, "p", &next)) {
+        return 0;
+    }
+
+    return load_slot_cb(key, len, read_cb, cb_arg, param);
+}
+
+/*
+ * Returns the decoded contents of a slot, from the cache or read from storage. The pointer is valid
+ * until the next call, which may evict it.
+ */
+static const struct keymap_slot* load_slot_payload(const uint8_t slot_idx) {
+    const struct slot_meta *meta = &config.slots[slot_idx];
+    if (meta->is_free) {
+        return NULL;
+    }
+
+    struct payload_cache_entry* entry = NULL;
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        if (config.cache.entries[i].slot_idx == slot_idx) {
+            entry = &config.cache.entries[i];
+            entry->last_used = ++config.cache.clock;
+            config.cache.hits++;
+            return &entry->slot;
+        }
+        if (entry == NULL && config.cache.entries[i].slot_idx < 0) {
+            entry = &config.cache.entries[i];
+        }
+    }
+
+    config.cache.misses++;
+    if (entry == NULL) {
+        entry = cache_lru(NULL);
+        if (entry == NULL) {
+            LOG_ERR("No cache entry free for slot %d", slot_idx + 1);
+            return NULL;
+        }
+        cache_evict(entry);
+        config.cache.evictions++;
+    }
+
+    struct keymap_slot* slot = &entry->slot;
+
+    char key[16];
+    int err;
+    if (meta->blob_chunks > 0) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+        struct shared_layer_data layers[ZMK_KEYMAP_LAYERS_LEN] = { 0 };
+        struct payload_load_param load = {
+            .slot = slot,
+            .slot_idx = slot_idx,
+            .shared = { .slot = slot, .refs = meta->shared, .count = meta->shared_count, .layers = layers },
+        };
+        if (meta->shared_count > 0 && meta->shared_count != SHARED_REFS_UNKNOWN) {
+            /* Every subtree scan walks the whole partition on NVS/ZMS, so the shared layers come along. */
+            err = storage_walk("slots", load_payload_cb, &load);
+            slot->shared_preload = &load.shared;
+        } else
+#endif
+        {
+            snprintf(key, sizeof(key), "slots/%d/p", slot_idx);
+            err = storage_walk(key, load_fragment_cb, slot);
+        }
+        if (err == 0) {
+            err = assemble_slot_blob(slot);
+        }
+        slot->shared_preload = NULL;
+    } else {
+        /* Not migrated yet: still one record per binding. */
+        struct cb_param data = { .sh = NULL, .slot = slot };
+        snprintf(key, sizeof(key), "slots/%d", slot_idx);
+        err = storage_walk(key, load_legacy_cb, &data);
+        slot->fingerprint = slot_fingerprint(slot);
+        if (err == 0 && slot->total_size == 0) {
+            err = -ENOENT;
+        }
+    }
+    if (err != 0) {
+        LOG_ERR("Slot %d is corrupted: %d", slot_idx + 1, err);
+        cache_evict(entry);
+        return NULL;
+    }
+
+    slot->fragments = NULL;
+    entry->slot_idx = slot_idx;
+    entry->last_used = ++config.cache.clock;
+    cache_trim(entry);
+    return slot;
+}
+
+static int keymap_shell_init(void) {
+    memset(&config.system, 0, sizeof(config.system));
+    memset(&config.cache, 0, sizeof(config.cache));
+    config.cache.pinned = -1;
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        config.cache.entries[i].slot_idx = -1;
+    }
+
+    const struct k_work_queue_config work_q_config = { .name = "keymap_shell" };
+    k_work_queue_init(&keymap_work_q);
+    k_work_queue_start(&keymap_work_q, keymap_work_stack, K_THREAD_STACK_SIZEOF(keymap_work_stack),
+                       CONFIG_ZMK_KEYMAP_SHELL_WORKQUEUE_PRIORITY, &work_q_config);
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        memset(&config.slots[i], 0, sizeof(config.slots[i]));
+    }
+
+    return 0;
+}
+
+static void report_save_err(const struct shell *sh, const char *what, const int err) {
+    if (sh != NULL) {
+        shprint(sh, "Failed to access %s! Error code = %d", what, err);
+    } else {
+        LOG_ERR("Failed to access %s! Error code = %d", what, err);
+    }
+}
+
+/* Writes a packed slot and drops chunks left over from a larger previous version. */
+static int write_slot_blob(const uint8_t slot_idx, const uint8_t *blob, const size_t size,
+                           struct slot_meta *meta, const struct shell *sh) {
+    const uint8_t old_chunks = meta->blob_chunks;
+
+    char key[24];
+    uint8_t chunks = 0;
+    for (size_t offset = 0; offset < size; offset += CONFIG_ZMK_KEYMAP_SHELL_BLOB_CHUNK_SIZE) {
+        snprintf(key, sizeof(key), "slots/%d/p/%d", slot_idx, chunks);
+        const int err = storage_save(key, &blob[offset], MIN(CONFIG_ZMK_KEYMAP_SHELL_BLOB_CHUNK_SIZE, size - offset));
+        chunks++;
+        if (err != 0) {
+            meta->blob_chunks = MAX(old_chunks, chunks);
+            report_save_err(sh, "slot data", err);
+            return err;
+        }
+    }
+
+    for (uint8_t i = chunks; i < old_chunks; i++) {
+        snprintf(key, sizeof(key), "slots/%d/p/%d", slot_idx, i);
+        storage_delete(key);
+    }
+
+    meta->blob_chunks = chunks;
+    return 0;
+}
+
+static bool slot_id_in_use(const uint16_t id) {
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        if (!config.slots[i].is_free && config.slots[i].id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* IDs only grow (until the counter wraps), so a stale reference can't pick up a newer slot. */
+static uint16_t allocate_slot_id(void) {
+    uint16_t id;
+    do {
+        id = config.next_id++;
+        if (config.next_id == 0) {
+            config.next_id = 1;
+        }
+    } while (id == 0 || slot_id_in_use(id));
+
+    const int err = storage_save("slots/next_id", &config.next_id, sizeof(config.next_id));
+    if (err != 0) {
+        LOG_ERR("Failed to save the slot ID counter: %d", err);
+    }
+    return id;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+static int parse_shared_key(const char *key, struct shared_ref *ref) {
+    char half[9] = { 0 };
+    char *endptr;
+    if (strlen(key) != 16) {
+        return -EINVAL;
+    }
+
+    memcpy(half, key, 8);
+    ref->crc = strtoul(half, &endptr, 16);
+    if (*endptr != '\0') {
+        return -EINVAL;
+    }
+
+    memcpy(half, &key[8], 8);
+    ref->hash = strtoul(half, &endptr, 16);
+    return *endptr == '\0' ? 0 : -EINVAL;
+}
+
+static bool shared_ref_eq(const struct shared_ref *a, const struct shared_ref *b) {
+    return a->crc == b->crc && a->hash == b->hash;
+}
+
+static bool shared_pool_contains(const struct shared_ref *ref) {
+    for (uint16_t i = 0; i < config.shared_count; i++) {
+        if (shared_ref_eq(&config.shared[i], ref)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Makes room for one more shared record in the table; false when the heap is out of memory. */
+static bool shared_pool_reserve(void) {
+    if (config.shared_count < config.shared_capacity) {
+        return true;
+    }
+
+    const uint16_t capacity = config.shared_capacity > 0 ? config.shared_capacity * 2 : 8;
+    struct shared_ref *shared = heap_alloc(capacity * sizeof(struct shared_ref));
+    if (shared == NULL) {
+        return false;
+    }
+
+    if (config.shared_count > 0) {
+        memcpy(shared, config.shared, config.shared_count * sizeof(struct shared_ref));
+    }
+    if (config.shared != NULL) {
+        heap_free(config.shared);
+    }
+    config.shared = shared;
+    config.shared_capacity = capacity;
+    return true;
+}
+
+static bool shared_pool_add(const struct shared_ref *ref) {
+    if (shared_pool_contains(ref)) {
+        return true;
+    }
+    if (!shared_pool_reserve()) {
+        return false;
+    }
+
+    config.shared[config.shared_count++] = *ref;
+    return true;
+}
+
+/* A slot left free by a failed save still counts while it has records: its old blob may have survived. */
+static bool shared_ref_in_use(const struct shared_ref *ref) {
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        const struct slot_meta *meta = &config.slots[i];
+        if (meta->blob_chunks == 0) {
+            continue;
+        }
+
+        for (uint8_t j = 0; j < meta->shared_count; j++) {
+            if (shared_ref_eq(&meta->shared[j], ref)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Reads the shared layer references of a slot whose first record didn't hold them all, from the start
+ * of its blob. A slot whose start can't be parsed can't be decoded either, so it is taken to refer to
+ * none; -ENOMEM leaves them unknown.
+ */
+static int slot_meta_resolve_shared(const uint8_t slot_idx) {
+    struct slot_meta *meta = &config.slots[slot_idx];
+    struct keymap_slot scratch = { 0 };
+    char key[16];
+    snprintf(key, sizeof(key), "slots/%d/p", slot_idx);
+    int err = storage_walk(key, load_fragment_cb, &scratch);
+    if (err == 0) {
+        uint8_t head[SLOT_BLOB_HEAD_MAX];
+        struct fragment_stream stream = { .fragments = scratch.fragments };
+        const size_t len = fragment_stream_read(&stream, head, sizeof(head));
+        const bool is_free = meta->is_free;
+        if (slot_meta_parse(meta, head, len) != 0) {
+            meta->shared_count = 0;
+        }
+        meta->is_free = is_free;
+        err = meta->shared_count == SHARED_REFS_UNKNOWN ? -ENOMEM : 0;
+    } else if (err != -ENOMEM) {
+        meta->shared_count = 0;
+        err = 0;
+    }
+
+    free_slot(&scratch);
+    return err;
+}
+
+/* Deletes shared layer records no slot refers to any more; not while some slot's references can't be read. */
+static void shared_collect(void) {
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        if (config.slots[i].blob_chunks > 0 && config.slots[i].shared_count == SHARED_REFS_UNKNOWN &&
+            slot_meta_resolve_shared(i) != 0) {
+            return;
+        }
+    }
+
+    char key[sizeof(SHARED_LAYER_TREE) + 17];
+    for (uint16_t i = 0; i < config.shared_count;) {
+        if (shared_ref_in_use(&config.shared[i])) {
+            i++;
+            continue;
+        }
+
+        shared_key(key, sizeof(key), &config.shared[i]);
+        storage_delete(key);
+        config.shared[i] = config.shared[--config.shared_count];
+    }
+}
+
+/*
+ * Moves the bindings of every layer of at least CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYER_MIN bytes into
+ * a shared record, writing the records that aren't stored yet. A layer too big for a single record
+ * stays inline.
+ */
+static int shared_plan_build(const struct keymap_slot *content, struct shared_plan *plan, struct slot_arena *scratch) {
+    memset(plan->layer_ref, SHARED_PLAN_INLINE, sizeof(plan->layer_ref));
+    plan->count = 0;
+
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        const struct layer_bindings view = slot_layer_bindings(content, i);
+        const struct layer_bindings *layer_bindings = &view;
+        struct blob_writer writer = { .buf = NULL, .pos = sizeof(layer_bindings->count) };
+        blob_put_bindings(&writer, layer_bindings);
+        if (layer_bindings->count == 0 || writer.pos < CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYER_MIN ||
+            writer.pos > CONFIG_ZMK_KEYMAP_SHELL_BLOB_CHUNK_SIZE) {
+            continue;
+        }
+
+        writer.buf = arena_alloc(scratch, writer.pos);
+        if (writer.buf == NULL) {
+            return -ENOMEM;
+        }
+        writer.pos = 0;
+        blob_put(&writer, &layer_bindings->count, sizeof(layer_bindings->count));
+        blob_put_bindings(&writer, layer_bindings);
+
+        const struct shared_ref ref = {
+            .crc = crc32_ieee(writer.buf, writer.pos),
+            .hash = fnv1a(FNV_OFFSET_BASIS, writer.buf, writer.pos),
+        };
+
+        uint8_t index = 0;
+        while (index < plan->count && !shared_ref_eq(&plan->refs[index], &ref)) {
+            index++;
+        }
+
+        if (index == plan->count) {
+            if (!shared_pool_contains(&ref)) {
+                if (!shared_pool_reserve()) {
+                    continue;
+                }
+
+                char key[sizeof(SHARED_LAYER_TREE) + 17];
+                shared_key(key, sizeof(key), &ref);
+                const int err = storage_save(key, writer.buf, writer.pos);
+                if (err != 0) {
+                    return err;
+                }
+                shared_pool_add(&ref);
+            }
+            plan->refs[plan->count++] = ref;
+        }
+        plan->layer_ref[i] = index;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Packs content under the given name and bistable state, writes it and refreshes the slot metadata.
+ * An occupied slot keeps its ID, so references to it survive an overwrite.
+ */
+static int store_slot(const uint8_t slot_idx, const struct keymap_slot *content, const char *name,
+                      const uint8_t flags, const uint8_t bistable_slot, const struct shell *sh) {
+    const uint32_t start = stats_start();
+    struct slot_meta *meta = &config.slots[slot_idx];
+    struct slot_arena scratch = { 0 };
+
+    const struct shared_plan *layout = NULL;
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    /* Shared layers are written first, so the blob never refers to a record that isn't there. */
+    struct shared_plan plan;
+    const int plan_err = shared_plan_build(content, &plan, &scratch);
+    if (plan_err != 0) {
+        arena_release(&scratch);
+        report_save_err(sh, "shared layers", plan_err);
+        return plan_err;
+    }
+    layout = &plan;
+#endif
+
+    size_t size = slot_blob_encode(content, name, 0, flags, bistable_slot, layout, NULL);
+    uint8_t *blob = size <= UINT16_MAX ? arena_alloc(&scratch, size) : NULL;
+    if (blob == NULL) {
+        arena_release(&scratch);
+        if (sh != NULL) {
+            shprint(sh, "Not enough memory to pack the keymap (%d bytes).", (int)size);
+        } else {
+            LOG_ERR("Not enough memory to pack slot %d (%d bytes)", slot_idx + 1, (int)size);
+        }
+        return -ENOMEM;
+    }
+
+    const uint16_t id = !meta->is_free && meta->id != 0 ? meta->id : allocate_slot_id();
+    slot_blob_encode(content, name, id, flags, bistable_slot, layout, blob);
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_COMPRESS)
+    uint8_t *packed;
+    const size_t packed_size = slot_blob_compress(blob, size, &scratch, &packed);
+    if (packed_size > 0) {
+        blob = packed;
+        size = packed_size;
+    }
+#endif
+    cache_drop(slot_idx);
+
+    int err = write_slot_blob(slot_idx, blob, size, meta, sh);
+    if (err == 0) {
+        err = slot_meta_parse(meta, blob, size);
+        } else {
+        /* Part of the new blob may have been written; the slot is unusable until saved again. */
+        meta->is_free = true;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    if (err == 0) {
+        /* Layers the previous contents shared with no other slot. After a failed write the old first
+         * record may still be there, so they are kept. */
+        shared_collect();
+    }
+#endif
+
+    arena_release(&scratch);
+    stats_stop(STATS_SAVE, start);
+    return err;
+}
+
+/* Deletes every record of a slot: its packed chunks, plus per-key records if any are left. */
+static void erase_slot(const uint8_t slot_idx) {
+    const uint32_t start = stats_start();
+    struct slot_meta *meta = &config.slots[slot_idx];
+    KEYMAP_SHELL_TRACE_BEGIN("clear", slot_idx);
+
+    char key[24];
+    for (uint8_t i = 0; i < meta->blob_chunks; i++) {
+        snprintf(key, sizeof(key), "slots/%d/p/%d", slot_idx, i);
+        storage_delete(key);
+    }
+
+    if (meta->legacy) {
+        snprintf(key, sizeof(key), "slots/%d", slot_idx);
+        clear_slot(key);
+    }
+
+    cache_drop(slot_idx);
+    slot_meta_reset(meta);
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    shared_collect();
+#endif
+    KEYMAP_SHELL_TRACE_END("clear", slot_idx);
+    stats_stop(STATS_CLEAR, start);
+}
+
+/* Rewrites a slot stored per key in the packed format. */
+static void migrate_slot(const uint8_t slot_idx) {
+    struct slot_meta *meta = &config.slots[slot_idx];
+
+    if (meta->blob_chunks == 0) {
+        const struct keymap_slot *slot = load_slot_payload(slot_idx);
+        if (slot == NULL) {
+            return;
+        }
+
+        uint8_t flags = 0;
+        uint8_t bistable_slot = 0;
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+        if (slot->has_bistable) {
+            flags |= SLOT_BLOB_F_BISTABLE;
+            bistable_slot = slot->bistable_slot;
+        }
+#endif
+
+        const char *name = slot->name != NULL ? slot->name : "";
+        if (store_slot(slot_idx, slot, name, flags, bistable_slot, NULL) != 0) {
+            return;
+        }
+        LOG_INF("Slot %d rewritten in the packed format (%d bytes)", slot_idx + 1, meta->size);
+    }
+
+    if (meta->legacy) {
+        clear_slot_legacy(slot_idx);
+        meta->legacy = false;
+    }
+    settings_commit();
+}
+
+/* Records what the state was read against. A state read over unsaved changes is never reused, since saving
+ * them changes storage but not the live keymap. */
+static void mark_loaded(void) {
+    config.loaded_generation = atomic_get(&storage_generation);
+    if (zmk_keymap_check_unsaved_changes()) {
+        config.loaded_generation--;
+    }
+}
+
+/* With identical slots only the first is published; activating another one finds out on the keymap work
+ * queue that nothing needs writing. */
+static void publish_active_slot(void) {
+    atomic_set(&active_slot, 0);
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        const struct slot_meta *meta = &config.slots[i];
+        if (meta->is_free || meta->id == 0 || meta->fingerprint != config.system.fingerprint) {
+            continue;
+        }
+
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+        atomic_set(&active_bistable, meta->has_bistable ? meta->bistable_slot + 1 : 0);
+#endif
+        atomic_set(&active_slot, (atomic_val_t)((config.loaded_generation & 0xFFFF) << 16 | meta->id));
+        break;
+    }
+}
+
+static void refresh_system_state(void) {
+    config.system.is_free = config.system.total_size == 0;
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    config.system.is_free = config.system.is_free && zbs_get_slot() == ZBS_DEFAULT_SLOT;
+#endif
+    publish_active_slot();
+}
+
+/* Re-reads the live "keymap" overrides, which ZMK Studio may have changed since the last load. */
+static void load_system_overrides(void) {
+    free_slot(&config.system);
+
+    struct cb_param data = { .sh = NULL, .slot = &config.system };
+    const int err = storage_walk("keymap", load_slot_cb, &data);
+    if (err != 0) {
+        LOG_ERR("Failed to load system subtree for keymap: %d", err);
+    }
+
+    config.system.fingerprint = slot_fingerprint(&config.system);
+    mark_loaded();
+    refresh_system_state();
+}
+
+/* Routes "keymap/..." to the system slot; of "slots/<n>/..." only the metadata is kept. */
+static int load_all_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg, void *param) {
+    struct cb_param* data = (struct cb_param*) param;
+
+    const char *next;
+    if (settings_name_steq(key, "keymap", &next) && next) {
+        data->slot = &config.system;
+        return load_slot_cb(next, len, read_cb, cb_arg, param);
+    }
+
+    if (settings_name_steq(key, "slots", &next) && next) {
+        const char *id_next;
+        if (settings_name_steq(next, "next_id", &id_next)) {
+            uint16_t next_id;
+            if (len == sizeof(next_id) && read_cb(cb_arg, &next_id, sizeof(next_id)) == sizeof(next_id)) {
+                config.next_id = MAX(config.next_id, next_id);
+            }
+            return 0;
+        }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+        const char *shared_next;
+        if (settings_name_steq(next, "s", &shared_next) && shared_next) {
+            struct shared_ref ref;
+            if (parse_shared_key(shared_next, &ref) == 0) {
+                shared_pool_add(&ref);
+            }
+            return 0;
+        }
+#endif
+
+        char *endptr;
+        const unsigned long slot_idx = strtoul(next, &endptr, 10);
+        if (endptr == next || *endptr != '/' || slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
+            return 0;
+        }
+
+        struct slot_meta *meta = &config.slots[slot_idx];
+        if (settings_name_steq(endptr + 1, "p", &next) && next) {
+            const int index = parse_chunk_index(next, len);
+            if (index < 0) {
+                return index;
+            }
+
+            meta->blob_chunks = MAX(meta->blob_chunks, index + 1);
+            if (index == 0) {
+                /* The header, name and shared layer references lead the first record; the rest is read
+                 * when the slot is used. */
+                uint8_t head[SLOT_BLOB_HEAD_MAX];
+                const ssize_t size = read_cb(cb_arg, head, MIN(len, sizeof(head)));
+                if (size <= 0 || slot_meta_parse(meta, head, size) != 0) {
+                    LOG_ERR("Slot %d is corrupted", (int)slot_idx + 1);
+                }
+            }
+            return 0;
+        }
+
+        meta->legacy = true;
+        if (meta->blob_chunks == 0) {
+            meta->is_free = false;
+            if (settings_name_steq(endptr + 1, "_name", &next)) {
+                const ssize_t size = read_cb(cb_arg, meta->name, MIN(len, sizeof(meta->name) - 1));
+                meta->name[MAX(size, 0)] = '\0';
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void load_system(const struct shell *sh) {
+    const uint32_t start = stats_start();
+    forget_slots();
+    shprint(sh, "Reading keymap and slots...");
+
+    /* One pass over storage: every subtree scan walks the whole partition on NVS/ZMS. */
+    struct cb_param data = { .sh = sh, .slot = NULL };
+    const int err = storage_walk(NULL, load_all_cb, &data);
+    if (err != 0) {
+        LOG_ERR("Failed to load keymap slots: %d", err);
+    }
+
+    config.system.fingerprint = slot_fingerprint(&config.system);
+    cache_revalidate();
+
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        if (!config.slots[i].is_free && config.slots[i].id >= config.next_id) {
+            config.next_id = config.slots[i].id == UINT16_MAX ? 1 : config.slots[i].id + 1;
+        }
+    }
+
+    config.initialized = true;
+    mark_loaded();
+    refresh_system_state();
+    stats_stop(STATS_LOAD, start);
+    shprint(sh, "");
+}
+
+/* Converts slots stored per key and drops orphaned shared layers. Writes to storage, so it runs once after
+ * boot on the keymap work queue and on "keymap init", never as part of a load. */
+static void maintain_storage(void) {
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        /* The packed copy wins over per-key records left behind by an interrupted migration. */
+        if (config.slots[i].legacy) {
+            migrate_slot(i);
+        }
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_SHARED_LAYERS)
+    /* Left behind when a save was interrupted between the shared layers and the slot. */
+    shared_collect();
+#endif
+}
+
+/* True when nothing was written since the state was read. While ZMK holds unsaved changes, saving them
+ * changes storage but not the live keymap, so it never is; nor is a state read while there were some. */
+static bool loaded_state_current(void) {
+    return config.initialized && config.loaded_generation == (uint32_t)atomic_get(&storage_generation) &&
+           !zmk_keymap_check_unsaved_changes();
+}
+
+static void sync_system_overrides(void) {
+    if (loaded_state_current()) {
+        refresh_system_state();
+        return;
+    }
+    load_system_overrides();
+}
+
+SYS_INIT(keymap_shell_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+int keymap_shell_ensure_initialized(void) {
+    state_lock_take();
+    if (!config.initialized) {
+        load_system(NULL);
+    }
+    state_lock_give();
+    return 0;
+}
+
+int keymap_shell_resolve_slot(const char *str) {
+    char *endptr;
+    const unsigned long parsed = strtoul(str, &endptr, 10);
+    if (*endptr == '\0' && parsed > 0 && parsed <= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
+        return (int)(parsed - 1);
+    }
+
+    int found = -1;
+    state_lock_take();
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        if (!config.slots[i].is_free && strcmp(config.slots[i].name, str) == 0) {
+            found = i;
+            break;
+        }
+    }
+    state_lock_give();
+
+    return found;
+}
+
+uint16_t keymap_shell_slot_id(const uint8_t slot_idx) {
+    if (slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
+        return 0;
+    }
+
+    state_lock_take();
+    const uint16_t id = config.slots[slot_idx].is_free ? 0 : config.slots[slot_idx].id;
+    state_lock_give();
+    return id;
+}
+
+int keymap_shell_find_slot_id(const uint16_t id) {
+    int found = -1;
+    state_lock_take();
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        if (id != 0 && !config.slots[i].is_free && config.slots[i].id == id) {
+            found = i;
+            break;
+        }
+    }
+    state_lock_give();
+    return found;
+}
+
+bool keymap_shell_slot_name(const uint8_t slot_idx, char *name, const size_t size) {
+    if (slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS || size == 0) {
+        return false;
+    }
+
+    state_lock_take();
+    const struct slot_meta *meta = &config.slots[slot_idx];
+    const bool named = !meta->is_free && meta->name[0] != '\0';
+    if (named) {
+        strncpy(name, meta->name, size - 1);
+        name[size - 1] = '\0';
+    }
+    state_lock_give();
+    return named;
+}
+
+/* Compares against the overrides as last loaded; callers reload them first when storage may have moved on. */
+static bool slot_is_active(const struct slot_meta *slot) {
+    if (slot->is_free || slot->fingerprint != config.system.fingerprint) {
+        return false;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    const uint8_t slot_bistable = slot->has_bistable ? slot->bistable_slot : ZBS_DEFAULT_SLOT;
+    if (zbs_get_slot() != slot_bistable) {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool keymap_shell_slot_id_is_active(const uint16_t id) {
+    const uint32_t published = atomic_get(&active_slot);
+    if (id == 0 || (published & 0xFFFF) != id ||
+        (published >> 16) != ((uint32_t)atomic_get(&storage_generation) & 0xFFFF)) {
+        return false;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    /* active_slot is cleared while the two are updated, so reading it again tells a torn pair. */
+    const uint32_t bistable = atomic_get(&active_bistable);
+    if ((uint32_t)atomic_get(&active_slot) != published ||
+        zbs_get_slot() != (bistable != 0 ? bistable - 1 : ZBS_DEFAULT_SLOT)) {
+        return false;
+    }
+#endif
+
+    return !zmk_keymap_check_unsaved_changes();
+}
+
+static bool blob_equals(const uint8_t* a, const ssize_t a_size, const uint8_t* b, const ssize_t b_size) {
+    return a_size == b_size && (a_size == 0 || memcmp(a, b, a_size) == 0);
+}
+
+enum slot_change {
+    SLOT_CHANGE_ORDER,
+    SLOT_CHANGE_NAME,
+    SLOT_CHANGE_ADDED,
+    SLOT_CHANGE_REMOVED,
+    SLOT_CHANGE_CHANGED,
+};
+
+/* One difference between two slots; from and to are empty for a side that lacks the record. */
+struct slot_difference {
+    enum slot_change change;
+    uint8_t layer;
+    uint16_t index;
+    const uint8_t *from;
+    uint8_t from_size;
+    const uint8_t *to;
+    uint8_t to_size;
+};
+
+/* Gets every difference in turn; a non-zero return stops the comparison, which then returns it. */
+typedef int (*slot_difference_cb)(const struct slot_difference *difference, void *user_data);
+
+static const struct layer_name *next_layer_name(const struct keymap_slot *slot, uint8_t *pos, const uint8_t layer) {
+    while (*pos < slot->name_count && (slot->names[*pos].layer < layer || slot->names[*pos].length == 0)) {
+        (*pos)++;
+    }
+    return *pos < slot->name_count && slot->names[*pos].layer == layer ? &slot->names[*pos] : NULL;
+}
+
+static uint32_t next_layer(const struct keymap_slot *slot, const uint16_t binding, const uint8_t name) {
+    uint32_t layer = UINT32_MAX;
+    if (binding < slot->binding_count) {
+        layer = slot->bindings[binding].layer;
+    }
+    if (name < slot->name_count) {
+        layer = MIN(layer, slot->names[name].layer);
+    }
+    return layer;
+}
+
+/*
+ * Reports what differs from slot a to slot b (either NULL for the stock keymap): the layer order,
+ * then layer by layer its name and bindings, in position order. Both binding tables are sorted, so
+ * this is one merge over them, linear in their size and without allocating.
+ */
+static int slot_compare(const struct keymap_slot *a, const struct keymap_slot *b, const slot_difference_cb cb,
+                        void *user_data) {
+    static const struct keymap_slot stock;
+    a = a != NULL ? a : &stock;
+    b = b != NULL ? b : &stock;
+
+    struct slot_difference difference = { 0 };
+    int err;
+    if (!blob_equals(a->order_data, a->order_size, b->order_data, b->order_size)) {
+        difference.change = SLOT_CHANGE_ORDER;
+        difference.from = a->order_data;
+        difference.from_size = a->order_size;
+        difference.to = b->order_data;
+        difference.to_size = b->order_size;
+        if ((err = cb(&difference, user_data)) != 0) {
+            return err;
+        }
+    }
+
+    uint16_t i = 0;
+    uint16_t j = 0;
+    uint8_t a_name = 0;
+    uint8_t b_name = 0;
+    while (true) {
+        const uint32_t layer = MIN(next_layer(a, i, a_name), next_layer(b, j, b_name));
+        if (layer == UINT32_MAX) {
+            break;
+        }
+
+        const struct layer_name *from_name = next_layer_name(a, &a_name, layer);
+        const struct layer_name *to_name = next_layer_name(b, &b_name, layer);
+        difference.layer = layer;
+        difference.index = 0;
+        difference.from = from_name != NULL ? from_name->data : NULL;
+        difference.from_size = from_name != NULL ? from_name->length : 0;
+        difference.to = to_name != NULL ? to_name->data : NULL;
+        difference.to_size = to_name != NULL ? to_name->length : 0;
+        if (!blob_equals(difference.from, difference.from_size, difference.to, difference.to_size)) {
+            difference.change = SLOT_CHANGE_NAME;
+            if ((err = cb(&difference, user_data)) != 0) {
+                return err;
+            }
+        }
+
+        while (true) {
+            const struct binding_entry *from =
+                i < a->binding_count && a->bindings[i].layer == layer ? &a->bindings[i] : NULL;
+            const struct binding_entry *to =
+                j < b->binding_count && b->bindings[j].layer == layer ? &b->bindings[j] : NULL;
+            if (from == NULL && to == NULL) {
+                break;
+            }
+
+            if (to == NULL || (from != NULL && from->index < to->index)) {
+                difference.change = SLOT_CHANGE_REMOVED;
+                to = NULL;
+                i++;
+            } else if (from == NULL || to->index < from->index) {
+                difference.change = SLOT_CHANGE_ADDED;
+                from = NULL;
+                j++;
+            } else {
+                i++;
+                j++;
+                if (blob_equals(from->data, from->length, to->data, to->length)) {
+                    continue;
+                }
+                difference.change = SLOT_CHANGE_CHANGED;
+            }
+
+            difference.index = from != NULL ? from->index : to->index;
+            difference.from = from != NULL ? from->data : NULL;
+            difference.from_size = from != NULL ? from->length : 0;
+            difference.to = to != NULL ? to->data : NULL;
+            difference.to_size = to != NULL ? to->length : 0;
+            if ((err = cb(&difference, user_data)) != 0) {
+                return err;
+            }
+        }
+
+        /* Names are only ever looked up at or past the current layer. */
+        if (a_name < a->name_count && a->names[a_name].layer == layer) {
+            a_name++;
+        }
+        if (b_name < b->name_count && b->names[b_name].layer == layer) {
+            b_name++;
+        }
+    }
+
+    return 0;
+}
+
+static int save_override(const char *key, const void *data, const ssize_t len, const char *what,
+                         const bool dry_run) {
+    if (dry_run) {
+        return 0;
+    }
+
+    const int err = len > 0 ? storage_save(key, data, len) : storage_delete(key);
+    if (err != 0) {
+        report_save_err(NULL, what, err);
+    }
+    return err;
+}
+
+struct override_writer {
+    bool dry_run;
+    int ops;
+};
+
+static int save_override_cb(const struct slot_difference *difference, void *user_data) {
+    struct override_writer *writer = user_data;
+    char key[32];
+    int err;
+
+    switch (difference->change) {
+    case SLOT_CHANGE_ORDER:
+        err = save_override("keymap/layer_order", difference->to, difference->to_size, "layer order",
+                            writer->dry_run);
+        break;
+    case SLOT_CHANGE_NAME:
+        snprintf(key, sizeof(key), "keymap/l_n/%d", difference->layer);
+        err = save_override(key, difference->to, difference->to_size, "layer name", writer->dry_run);
+        break;
+    default:
+        snprintf(key, sizeof(key), "keymap/l/%d/%d", difference->layer, difference->index);
+        err = save_override(key, difference->to, difference->to_size, "layer binding", writer->dry_run);
+        break;
+    }
+
+    if (err == 0) {
+        writer->ops++;
+    }
+    return err;
+}
+
+/*
+ * Brings the "keymap" overrides from current to target (NULL for the stock keymap), writing only
+ * the records that differ. current must reflect what is stored. Returns the number of settings
+ * operations, which a dry run only counts.
+ */
+static int save_overrides_diff(const struct keymap_slot *current, const struct keymap_slot *target,
+                               const bool dry_run) {
+    struct override_writer writer = { .dry_run = dry_run };
+    const int err = slot_compare(current, target, save_override_cb, &writer);
+    if (err != 0) {
+        return err;
+    }
+
+    if (!dry_run) {
+        LOG_DBG("Keymap overrides updated with %d settings operations", writer.ops);
+    }
+    return writer.ops;
+}
+
+/*
+ * ZMK reads the "keymap" subtree itself at boot, so it can't be split into banks. The stored slot
+ * is the inactive bank instead: a record naming it is written before a multi-record update and
+ * removed after, and an update cut short by a reset is finished from the slot on the next boot.
+ */
+#define APPLY_RECORD_KEY "ksapply/pending"
+
+struct apply_record {
+    uint16_t id;
+    uint32_t fingerprint;
+} __packed;
+
+static struct apply_record pending_apply;
+static bool pending_apply_loaded;
+
+/* Writes the overrides for target (NULL for the stock keymap), which is slot id. */
+static int write_overrides(const struct keymap_slot *target, const uint16_t id) {
+    const int ops = save_overrides_diff(&config.system, target, true);
+    if (ops == 0) {
+        return 0;
+    }
+
+    /* A single record is replaced atomically by the settings backend. */
+    const bool journaled = ops > 1;
+    if (journaled) {
+        const struct apply_record record = {
+            .id = id,
+            .fingerprint = target != NULL ? target->fingerprint : 0,
+        };
+        const int err = storage_save(APPLY_RECORD_KEY, &record, sizeof(record));
+        if (err != 0) {
+            report_save_err(NULL, "apply record", err);
+            return err;
+        }
+    }
+
+    const int err = save_overrides_diff(&config.system, target, false);
+    if (err < 0) {
+        return err;
+    }
+
+    if (journaled) {
+        storage_delete(APPLY_RECORD_KEY);
+    }
+    return 0;
+}
+
+/* Copies the keymap part of src (order, layer names, bindings) into dst; src == NULL empties dst. */
+static int copy_slot_content(struct keymap_slot *dst, const struct keymap_slot *src) {
+    free_slot(dst);
+    if (src == NULL) {
+        return 0;
+    }
+
+    if (src->order_size > 0) {
+        dst->order_data = arena_alloc(&dst->arena, src->order_size);
+        if (dst->order_data == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(dst->order_data, src->order_data, src->order_size);
+        dst->order_size = src->order_size;
+        dst->total_size += src->order_size;
+    }
+
+    if (slot_reserve_layer_names(dst, src->name_count) != 0 || slot_reserve_bindings(dst, src->binding_count) != 0) {
+        return -ENOMEM;
+    }
+
+    for (uint8_t i = 0; i < src->name_count; i++) {
+        const struct layer_name *from = &src->names[i];
+        struct layer_name *name = slot_put_layer_name(dst, from->layer);
+        if (name == NULL || (name->data = arena_alloc(&dst->arena, from->length)) == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(name->data, from->data, from->length);
+        name->length = from->length;
+        dst->total_size += from->length;
+    }
+
+    for (uint16_t i = 0; i < src->binding_count; i++) {
+        const struct binding_entry *from = &src->bindings[i];
+        struct binding_entry *entry = slot_put_binding(dst, from->layer, from->index);
+        if (entry == NULL || (entry->data = arena_alloc(&dst->arena, from->length)) == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(entry->data, from->data, from->length);
+        entry->length = from->length;
+        dst->total_size += from->length;
+    }
+
+    dst->fingerprint = src->fingerprint;
+    dst->is_free = false;
+    return 0;
+}
+
+#define KEYMAP_NODE DT_INST(0, zmk_keymap)
+#define STOCK_LAYER(node)                                                                         \
+    {COND_CODE_1(DT_NODE_HAS_PROP(node, bindings),                                                \
+                 (LISTIFY(DT_PROP_LEN(node, bindings), ZMK_KEYMAP_EXTRACT_BINDING, (, ), node)), ())}
+#define STOCK_LAYER_NAME(node) DT_PROP_OR(node, display_name, DT_PROP_OR(node, label, ""))
+
+/* The firmware keymap: what a binding or name no override covers is, for applying and diffing slots. */
+static const struct zmk_behavior_binding stock_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN] = {
+    DT_FOREACH_CHILD_SEP(KEYMAP_NODE, STOCK_LAYER, (, ))};
+static const char *const stock_layer_names[ZMK_KEYMAP_LAYERS_LEN] = {
+    DT_FOREACH_CHILD_SEP(KEYMAP_NODE, STOCK_LAYER_NAME, (, ))};
+
+static int decode_binding(const struct binding_entry *entry, struct zmk_behavior_binding *binding) {
+    struct binding_setting setting = { 0 };
+    memcpy(&setting, entry->data, MIN((size_t)entry->length, sizeof(setting)));
+
+    binding->behavior_dev = zmk_behavior_find_behavior_name_from_local_id(setting.behavior_local_id);
+    binding->param1 = setting.param1;
+    binding->param2 = setting.param2;
+    return binding->behavior_dev != NULL ? 0 : -ENODEV;
+}
+
+static bool binding_matches(const struct zmk_behavior_binding *a, const struct zmk_behavior_binding *b) {
+    if (a->param1 != b->param1 || a->param2 != b->param2) {
+        return false;
+    }
+
+    if (a->behavior_dev == NULL || b->behavior_dev == NULL) {
+        return a->behavior_dev == b->behavior_dev;
+    }
+    return strcmp(a->behavior_dev, b->behavior_dev) == 0;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_DIRECT_APPLY)
+static int16_t pending_persist = -1;
+static bool live_is_temporary;
+
+static void slot_layer_name(const struct keymap_slot *slot, const uint8_t layer, const char **name, size_t *size) {
+    uint8_t name_size;
+    const uint8_t *name_data = slot_layer_name_data(slot, layer, &name_size);
+    if (name_size > 0) {
+        *name = (const char *)name_data;
+        *size = name_size;
+    } else {
+        /* Entries past the devicetree layers are NULL. */
+        *name = stock_layer_names[layer] != NULL ? stock_layer_names[layer] : "";
+        *size = strlen(*name);
+    }
+}
+
+static bool live_layer_name_matches(const uint8_t layer, const char *name, const size_t size) {
+    const char *live = zmk_keymap_layer_name(layer);
+    if (live == NULL) {
+        live = "";
+    }
+    return strlen(live) == size && memcmp(live, name, size) == 0;
+}
+
+/* Fills order with the layer order the slot asks for; false if it can't be expressed as moves. */
+static bool slot_layer_order(const struct keymap_slot *slot, zmk_keymap_layer_id_t order[ZMK_KEYMAP_LAYERS_LEN]) {
+    if (slot->order_size == 0) {
+        for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+            order[i] = i;
+        }
+    } else if (slot->order_size == ZMK_KEYMAP_LAYERS_LEN) {
+        memcpy(order, slot->order_data, ZMK_KEYMAP_LAYERS_LEN);
+    } else {
+        return false;
+    }
+
+    /* Layers added or removed in ZMK Studio can't be replayed here, only reordered. */
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        bool found = order[i] == ZMK_KEYMAP_LAYER_ID_INVAL;
+        for (int j = 0; j < ZMK_KEYMAP_LAYERS_LEN && !found; j++) {
+            found = zmk_keymap_layer_index_to_id(j) == order[i];
+        }
+        if (!found || (order[i] == ZMK_KEYMAP_LAYER_ID_INVAL) !=
+                          (zmk_keymap_layer_index_to_id(i) == ZMK_KEYMAP_LAYER_ID_INVAL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Pushes a slot into the running keymap through ZMK's keymap API. Everything is validated first,
+ * so on -ENOTSUP the live keymap is untouched and the caller falls back to a settings reload.
+ */
+static int apply_slot_live(const struct keymap_slot *slot) {
+    zmk_keymap_layer_id_t order[ZMK_KEYMAP_LAYERS_LEN];
+    if (!slot_layer_order(slot, order)) {
+        return -ENOTSUP;
+    }
+
+    bool order_changed = false;
+    bool names_changed = false;
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        order_changed = order_changed || zmk_keymap_layer_index_to_id(i) != order[i];
+
+        const char *name;
+        size_t size;
+        slot_layer_name(slot, i, &name, &size);
+        names_changed = names_changed || !live_layer_name_matches(i, name, size);
+
+        const struct layer_bindings layer_bindings = slot_layer_bindings(slot, i);
+        for (uint16_t j = 0; j < layer_bindings.count; j++) {
+            struct zmk_behavior_binding binding;
+            if (layer_bindings.entries[j].index >= ZMK_KEYMAP_LEN ||
+                decode_binding(&layer_bindings.entries[j], &binding) != 0) {
+                return -ENOTSUP;
+            }
+        }
+    }
+
+    if ((order_changed || names_changed) && !IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYER_REORDERING)) {
+        return -ENOTSUP;
+    }
+
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        const struct layer_bindings layer_bindings = slot_layer_bindings(slot, i);
+        uint8_t overridden[DIV_ROUND_UP(ZMK_KEYMAP_LEN, 8)] = { 0 };
+
+        for (uint16_t j = 0; j < layer_bindings.count; j++) {
+            const uint16_t pos = layer_bindings.entries[j].index;
+            struct zmk_behavior_binding binding;
+            decode_binding(&layer_bindings.entries[j], &binding);
+            overridden[pos / 8] |= BIT(pos % 8);
+
+            if (!binding_matches(zmk_keymap_get_layer_binding_at_idx(i, pos), &binding)) {
+                zmk_keymap_set_layer_binding_at_idx(i, pos, binding);
+            }
+        }
+
+        for (uint16_t pos = 0; pos < ZMK_KEYMAP_LEN; pos++) {
+            if ((overridden[pos / 8] & BIT(pos % 8)) == 0 &&
+                !binding_matches(zmk_keymap_get_layer_binding_at_idx(i, pos), &stock_keymap[i][pos])) {
+                zmk_keymap_set_layer_binding_at_idx(i, pos, stock_keymap[i][pos]);
+            }
+        }
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYER_REORDERING)
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN && names_changed; i++) {
+        const char *name;
+        size_t size;
+        slot_layer_name(slot, i, &name, &size);
+        if (!live_layer_name_matches(i, name, size)) {
+            zmk_keymap_set_layer_name(i, name, size);
+        }
+    }
+
+    for (int dest = 0; dest < ZMK_KEYMAP_LAYERS_LEN && order_changed; dest++) {
+        for (int src = dest; src < ZMK_KEYMAP_LAYERS_LEN; src++) {
+            if (zmk_keymap_layer_index_to_id(src) == order[dest]) {
+                if (src != dest) {
+                    zmk_keymap_move_layer(src, dest);
+                }
+                break;
+            }
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* Writes the last directly applied slot to the "keymap" overrides. */
+static void persist_applied_slot(void) {
+    if (pending_persist < 0) {
+        return;
+    }
+
+    const uint8_t slot_idx = pending_persist;
+    pending_persist = -1;
+    if (config.slots[slot_idx].is_free) {
+        return;
+    }
+
+    sync_system_overrides();
+    bool written = false;
+    if (config.system.fingerprint != config.slots[slot_idx].fingerprint) {
+        /* Normally still loaded from the activation itself. */
+        const struct keymap_slot *slot = load_slot_payload(slot_idx);
+        if (slot == NULL) {
+            return;
+        }
+
+        KEYMAP_SHELL_TRACE_BEGIN("write", slot_idx);
+        const int err = write_overrides(slot, config.slots[slot_idx].id);
+        KEYMAP_SHELL_TRACE_END("write", slot_idx);
+        if (err == 0) {
+            written = copy_slot_content(&config.system, slot) == 0;
+            if (!written) {
+                free_slot(&config.system);
+            }
+        }
+
+        KEYMAP_SHELL_TRACE_BEGIN("commit", slot_idx);
+        settings_commit();
+        KEYMAP_SHELL_TRACE_END("commit", slot_idx);
+    }
+
+    if (!live_is_temporary) {
+        /* The live keymap already matches; reloading only clears ZMK's pending-change state. */
+        KEYMAP_SHELL_TRACE_BEGIN("discard", slot_idx);
+        zmk_keymap_discard_changes();
+        KEYMAP_SHELL_TRACE_END("discard", slot_idx);
+    }
+    if (written) {
+        mark_loaded();
+    }
+    refresh_system_state();
+}
+
+static void persist_work_handler(struct k_work *work) {
+    state_lock_take();
+    persist_applied_slot();
+    state_lock_give();
+}
+static K_WORK_DEFINE(persist_work, persist_work_handler);
+
+/* Waits for a queued persist so shell commands see the stored overrides. Not for the work queue itself. */
+static void flush_pending_persist(void) {
+    struct k_work_sync sync;
+    k_work_flush(&persist_work, &sync);
+}
+
+/*
+ * Forgets a queued persist. Elsewhere than on the keymap work queue this waits for one that is already
+ * running, so it must be called without state_lock held. On the queue the handler can't be running.
+ */
+static void drop_pending_persist(void) {
+    if (k_current_get() == k_work_queue_thread_get(&keymap_work_q)) {
+        k_work_cancel(&persist_work);
+    } else {
+        struct k_work_sync sync;
+        k_work_cancel_sync(&persist_work, &sync);
+    }
+
+    state_lock_take();
+    pending_persist = -1;
+    live_is_temporary = false;
+    state_lock_give();
+}
+
+#if IS_ENABLED(CONFIG_ZMK_STUDIO)
+/* A ZMK Studio save stores whatever the live keymap holds, so a temporary slot is dropped before Studio
+ * can save it, putting back the stored keymap. */
+static void temporary_discard_work_handler(struct k_work *work) {
+    state_lock_take();
+    if (live_is_temporary) {
+        LOG_INF("ZMK Studio unlocked, discarding the temporary keymap");
+        live_is_temporary = false;
+        zmk_keymap_discard_changes();
+        refresh_system_state();
+    }
+    state_lock_give();
+}
+static K_WORK_DEFINE(temporary_discard_work, temporary_discard_work_handler);
+
+static int studio_lock_listener(const zmk_event_t *eh) {
+    const struct zmk_studio_core_lock_state_changed *ev = as_zmk_studio_core_lock_state_changed(eh);
+    if (ev != NULL && ev->state == ZMK_STUDIO_CORE_LOCK_STATE_UNLOCKED) {
+        k_work_submit_to_queue(&keymap_work_q, &temporary_discard_work);
+    }
+    return ZMK_EV_EVENT_BUBBLE;
+}
+
+ZMK_LISTENER(keymap_shell_studio, studio_lock_listener);
+ZMK_SUBSCRIPTION(keymap_shell_studio, zmk_studio_core_lock_state_changed);
+#endif
+#else
+static void flush_pending_persist(void) {
+}
+
+static void drop_pending_persist(void) {
+}
+#endif
+
+/* Callers drop a queued persist first. */
+static void restore_keymap(void) {
+    const uint32_t start = stats_start();
+    sync_system_overrides();
+    KEYMAP_SHELL_TRACE_BEGIN("write", KEYMAP_SHELL_REQUEST_RESTORE);
+    const bool written = write_overrides(NULL, 0) == 0;
+    if (written) {
+        free_slot(&config.system);
+    }
+    KEYMAP_SHELL_TRACE_END("write", KEYMAP_SHELL_REQUEST_RESTORE);
+
+    KEYMAP_SHELL_TRACE_BEGIN("commit", KEYMAP_SHELL_REQUEST_RESTORE);
+    settings_commit();
+    KEYMAP_SHELL_TRACE_END("commit", KEYMAP_SHELL_REQUEST_RESTORE);
+    KEYMAP_SHELL_TRACE_BEGIN("discard", KEYMAP_SHELL_REQUEST_RESTORE);
+    zmk_keymap_discard_changes();
+    KEYMAP_SHELL_TRACE_END("discard", KEYMAP_SHELL_REQUEST_RESTORE);
+    if (written) {
+        mark_loaded();
+    }
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    KEYMAP_SHELL_TRACE_BEGIN("bistable", KEYMAP_SHELL_REQUEST_RESTORE);
+    zbs_set_slot(ZBS_DEFAULT_SLOT);
+    KEYMAP_SHELL_TRACE_END("bistable", KEYMAP_SHELL_REQUEST_RESTORE);
+#endif
+    refresh_system_state();
+#if IS_ENABLED(CONFIG_ZMK_ADAPTIVE_FEEDBACK)
+    KEYMAP_SHELL_TRACE_BEGIN("feedback", KEYMAP_SHELL_REQUEST_RESTORE);
+    zaf_custom_event_trigger(&ks_keymap_changed);
+    KEYMAP_SHELL_TRACE_END("feedback", KEYMAP_SHELL_REQUEST_RESTORE);
+#endif
+    stats_stop(STATS_RESTORE, start);
+}
+
+void keymap_restore() {
+    drop_pending_persist();
+    state_lock_take();
+    restore_keymap();
+    state_lock_give();
+}
+
+static void finish_activation(const uint8_t slot_idx) {
+    const struct slot_meta* slot = &config.slots[slot_idx];
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    KEYMAP_SHELL_TRACE_BEGIN("bistable", slot_idx);
+    zbs_set_slot(slot->has_bistable ? slot->bistable_slot : ZBS_DEFAULT_SLOT);
+    KEYMAP_SHELL_TRACE_END("bistable", slot_idx);
+#endif
+    refresh_system_state();
+
+    LOG_INF("Slot %d (%s) successfully activated!", slot_idx + 1, slot->name);
+#if IS_ENABLED(CONFIG_ZMK_ADAPTIVE_FEEDBACK)
+    KEYMAP_SHELL_TRACE_BEGIN("feedback", slot_idx);
+    zaf_custom_event_trigger(&ks_keymap_changed);
+    KEYMAP_SHELL_TRACE_END("feedback", slot_idx);
+#endif
+}
+
+static int activate_slot(const uint8_t slot_idx, const bool persist) {
+    if (slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
+        return -EINVAL;
+    }
+
+    if (!config.initialized) {
+        return -EBUSY;
+    }
+
+    if (config.slots[slot_idx].is_free) {
+        return -ENOENT;
+    }
+
+    const struct keymap_slot* slot;
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_DIRECT_APPLY)
+#if IS_ENABLED(CONFIG_ZMK_STUDIO)
+    if (!persist && zmk_studio_core_get_lock_state() == ZMK_STUDIO_CORE_LOCK_STATE_UNLOCKED) {
+        /* Studio could save it; once locked, unlocking discards it instead. */
+        return -EACCES;
+    }
+#endif
+    KEYMAP_SHELL_TRACE_BEGIN("resolve", slot_idx);
+    slot = load_slot_payload(slot_idx);
+    KEYMAP_SHELL_TRACE_END("resolve", slot_idx);
+    if (slot == NULL) {
+        return -EIO;
+    }
+
+    KEYMAP_SHELL_TRACE_BEGIN("apply", slot_idx);
+    const int applied = apply_slot_live(slot);
+    KEYMAP_SHELL_TRACE_END("apply", slot_idx);
+    if (applied == 0) {
+        live_is_temporary = !persist;
+        if (persist) {
+            pending_persist = slot_idx;
+            k_work_submit_to_queue(&keymap_work_q, &persist_work);
+        }
+
+        finish_activation(slot_idx);
+        return 0;
+    }
+
+    LOG_DBG("Slot %d can't be applied directly, reloading from settings", slot_idx + 1);
+#endif
+    if (!persist) {
+        return -ENOTSUP;
+    }
+
+    sync_system_overrides();
+    if (slot_is_active(&config.slots[slot_idx]) && !zmk_keymap_check_unsaved_changes()) {
+        LOG_DBG("Slot %d is already active", slot_idx + 1);
+        finish_activation(slot_idx);
+        return 0;
+    }
+
+    KEYMAP_SHELL_TRACE_BEGIN("resolve", slot_idx);
+    slot = load_slot_payload(slot_idx);
+    KEYMAP_SHELL_TRACE_END("resolve", slot_idx);
+    if (slot == NULL) {
+        return -EIO;
+    }
+
+    KEYMAP_SHELL_TRACE_BEGIN("write", slot_idx);
+    int err = write_overrides(slot, config.slots[slot_idx].id);
+    KEYMAP_SHELL_TRACE_END("write", slot_idx);
+    if (err != 0) {
+        return err;
+    }
+
+    err = copy_slot_content(&config.system, slot);
+    if (err != 0) {
+        /* Storage is up to date; the overrides are simply re-read on the next activation. */
+        free_slot(&config.system);
+    }
+
+    KEYMAP_SHELL_TRACE_BEGIN("commit", slot_idx);
+    settings_commit();
+    KEYMAP_SHELL_TRACE_END("commit", slot_idx);
+    KEYMAP_SHELL_TRACE_BEGIN("discard", slot_idx);
+    zmk_keymap_discard_changes();
+    KEYMAP_SHELL_TRACE_END("discard", slot_idx);
+    if (err == 0) {
+        /* The overrides in memory are what was just written. */
+        mark_loaded();
+    }
+
+    finish_activation(slot_idx);
+    return 0;
+}
+
+int keymap_shell_activate_slot(const uint8_t slot_idx) {
+    /* The activation supersedes a persist still queued from an earlier one. */
+    drop_pending_persist();
+    state_lock_take();
+    const uint32_t start = stats_start();
+    KEYMAP_SHELL_TRACE_BEGIN("switch", slot_idx);
+    const int err = activate_slot(slot_idx, true);
+    KEYMAP_SHELL_TRACE_END("switch", slot_idx);
+    stats_stop(STATS_ACTIVATE, start);
+    state_lock_give();
+    return err;
+}
+
+int keymap_shell_activate_slot_temp(const uint8_t slot_idx) {
+    state_lock_take();
+    const uint32_t start = stats_start();
+    KEYMAP_SHELL_TRACE_BEGIN("switch", slot_idx);
+    const int err = activate_slot(slot_idx, false);
+    KEYMAP_SHELL_TRACE_END("switch", slot_idx);
+    stats_stop(STATS_ACTIVATE, start);
+    state_lock_give();
+    return err;
+}
+
+/* Finishes an override update that a reset interrupted, from the slot it was applying. */
+static void recover_work_handler(struct k_work *work) {
+    drop_pending_persist();
+    state_lock_take();
+    const struct apply_record record = pending_apply;
+    keymap_shell_ensure_initialized();
+
+    if (config.system.fingerprint != record.fingerprint) {
+        const int slot_idx = record.id != 0 ? keymap_shell_find_slot_id(record.id) : -1;
+        if (record.id == 0) {
+            LOG_WRN("Finishing interrupted keymap restore");
+            restore_keymap();
+        } else if (slot_idx >= 0 && config.slots[slot_idx].fingerprint == record.fingerprint) {
+            LOG_WRN("Finishing interrupted activation of slot %d", slot_idx + 1);
+            activate_slot(slot_idx, true);
+        } else {
+            LOG_ERR("Interrupted activation can't be finished, its slot has changed");
+        }
+    }
+
+    /* The record isn't part of the overrides, so dropping it keeps what was read of them current. */
+    const bool current = loaded_state_current();
+    storage_delete(APPLY_RECORD_KEY);
+    settings_commit();
+    if (current) {
+        mark_loaded();
+        refresh_system_state();
+    }
+    state_lock_give();
+}
+static K_WORK_DEFINE(recover_work, recover_work_handler);
+
+static atomic_t maintenance_queued;
+
+static void maintenance_work_handler(struct k_work *work) {
+    state_lock_take();
+    keymap_shell_ensure_initialized();
+    maintain_storage();
+    state_lock_give();
+}
+static K_WORK_DEFINE(maintenance_work, maintenance_work_handler);
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_PREFETCH)
+/* Slots to decode into the cache in the background; the active one is added on the first run. */
+static ATOMIC_DEFINE(prefetch_slots, CONFIG_ZMK_KEYMAP_SHELL_SLOTS);
+static atomic_t prefetch_queued;
+static bool prefetch_seeded;
+
+/* Slots asked for by ID, looked up by the next run; guarded by prefetch_lock. */
+static struct k_spinlock prefetch_lock;
+static uint16_t prefetch_ids[CONFIG_ZMK_KEYMAP_SHELL_SLOTS];
+
+static bool cache_holds(const uint8_t slot_idx) {
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        if (config.cache.entries[i].slot_idx == slot_idx) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reads the slot metadata, then decodes one wanted slot per run, so activations queued in between go
+ * first. Gives up on the rest once the cache would grow past the prefetch budget. */
+static void prefetch_work_handler(struct k_work *work) {
+    state_lock_take();
+    keymap_shell_ensure_initialized();
+
+    const k_spinlock_key_t key = k_spin_lock(&prefetch_lock);
+    uint16_t ids[CONFIG_ZMK_KEYMAP_SHELL_SLOTS];
+    memcpy(ids, prefetch_ids, sizeof(ids));
+    memset(prefetch_ids, 0, sizeof(prefetch_ids));
+    k_spin_unlock(&prefetch_lock, key);
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        const int slot_idx = ids[i] != 0 ? keymap_shell_find_slot_id(ids[i]) : -1;
+        if (slot_idx >= 0) {
+            atomic_set_bit(prefetch_slots, slot_idx);
+        }
+    }
+
+    if (!prefetch_seeded) {
+        prefetch_seeded = true;
+        for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+            if (slot_is_active(&config.slots[i])) {
+                atomic_set_bit(prefetch_slots, i);
+            }
+        }
+    }
+
+    for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
+        const struct slot_meta *meta = &config.slots[i];
+        if (!atomic_test_and_clear_bit(prefetch_slots, i) || meta->is_free || cache_holds(i)) {
+            continue;
+        }
+
+        if (cache_usage() + MAX(meta->raw_size, meta->size) > CONFIG_ZMK_KEYMAP_SHELL_PREFETCH_BYTES) {
+            LOG_DBG("Prefetch budget reached at slot %d", i + 1);
+            for (int j = i + 1; j < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; j++) {
+                atomic_clear_bit(prefetch_slots, j);
+            }
+            break;
+        }
+
+        load_slot_payload(i);
+        k_work_submit_to_queue(&keymap_work_q, work);
+        break;
+    }
+    state_lock_give();
+}
+static K_WORK_DEFINE(prefetch_work, prefetch_work_handler);
+#endif
 
-int keymap_shell_ensure_initialized(void) {
-    if (!config.initialized) {
-        load_system(NULL);
+void keymap_shell_prefetch_slot(const uint8_t slot_idx) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_PREFETCH)
+    if (slot_idx < CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
+        atomic_set_bit(prefetch_slots, slot_idx);
+        k_work_submit_to_queue(&keymap_work_q, &prefetch_work);
     }
-    return 0;
+#endif
 }
 
-int keymap_shell_resolve_slot(const char *str) {
-    char *endptr;
-    const unsigned long parsed = strtoul(str, &endptr, 10);
-    if (*endptr == '\0' && parsed > 0 && parsed <= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
-        return (int)(parsed - 1);
+void keymap_shell_prefetch_slot_id(const uint16_t id) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_PREFETCH)
+    if (id == 0) {
+        return;
     }
 
+    const k_spinlock_key_t key = k_spin_lock(&prefetch_lock);
     for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
-        if (!config.slots[i].is_free && config.slots[i].name != NULL &&
-            strcmp(config.slots[i].name, str) == 0) {
-            return i;
+        if (prefetch_ids[i] == id || prefetch_ids[i] == 0) {
+            prefetch_ids[i] = id;
+            break;
         }
     }
+    k_spin_unlock(&prefetch_lock, key);
+    k_work_submit_to_queue(&keymap_work_q, &prefetch_work);
+#endif
+}
 
-    return -1;
+static int apply_record_set(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg) {
+    if (settings_name_steq(key, "pending", NULL) && len == sizeof(pending_apply)) {
+        pending_apply_loaded = read_cb(cb_arg, &pending_apply, sizeof(pending_apply)) == sizeof(pending_apply);
+    }
+    return 0;
 }
 
-const char *keymap_shell_slot_name(const uint8_t slot_idx) {
-    if (slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS || config.slots[slot_idx].is_free) {
-        return NULL;
+/* Runs in whichever thread commits settings; the work it queues takes state_lock itself. */
+static int apply_record_commit(void) {
+    atomic_inc(&storage_generation);
+    if (pending_apply_loaded) {
+        pending_apply_loaded = false;
+        k_work_submit_to_queue(&keymap_work_q, &recover_work);
+    }
+    if (atomic_cas(&maintenance_queued, 0, 1)) {
+        k_work_submit_to_queue(&keymap_work_q, &maintenance_work);
+    }
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_PREFETCH)
+    /* After the recovery, so the cache is filled from the overrides it finishes writing. */
+    if (atomic_cas(&prefetch_queued, 0, 1)) {
+        k_work_submit_to_queue(&keymap_work_q, &prefetch_work);
     }
-    return config.slots[slot_idx].name;
+#endif
+    return 0;
 }
 
-static void report_save_err(const struct shell *sh, const char *what, const int err) {
-    if (sh != NULL) {
-        shprint(sh, "Failed to access %s! Error code = %d", what, err);
+SETTINGS_STATIC_HANDLER_DEFINE(keymap_shell_apply, "ksapply", NULL, apply_record_set, apply_record_commit, NULL);
+
+struct activation_request {
+    int16_t slot_idx;
+    /* When not 0, the slot to activate, looked up once the slots are loaded; slot_idx is ignored. */
+    uint16_t slot_id;
+    enum keymap_shell_source source;
+    keymap_shell_request_cb cb;
+    void *user_data;
+    bool queued;
+};
+
+static struct k_spinlock request_lock;
+static struct activation_request pending_request;
+
+static void request_work_handler(struct k_work *work) {
+    const k_spinlock_key_t key = k_spin_lock(&request_lock);
+    const struct activation_request request = pending_request;
+    pending_request.queued = false;
+    k_spin_unlock(&request_lock, key);
+
+    if (!request.queued) {
+        return;
+    }
+
+    int err = 0;
+    stats_count_activation(request.source);
+    if (request.slot_id == 0 && request.slot_idx == KEYMAP_SHELL_REQUEST_RESTORE) {
+        keymap_restore();
     } else {
-        LOG_ERR("Failed to access %s! Error code = %d", what, err);
+        keymap_shell_ensure_initialized();
+        const int slot_idx = request.slot_id != 0 ? keymap_shell_find_slot_id(request.slot_id) : request.slot_idx;
+        err = slot_idx >= 0 ? keymap_shell_activate_slot(slot_idx) : -ENOENT;
+    }
+
+    if (request.cb != NULL) {
+        request.cb(err, request.user_data);
     }
 }
+static K_WORK_DEFINE(request_work, request_work_handler);
 
-static int save_slot_payload(const char *prefix, const struct keymap_slot *slot,
-                             const struct shell *sh) {
-    char key[40];
-    int err;
+static void queue_request(const struct activation_request *request) {
+    const k_spinlock_key_t key = k_spin_lock(&request_lock);
+    const struct activation_request replaced = pending_request;
+    pending_request = *request;
+    k_spin_unlock(&request_lock, key);
 
-    if (slot->order_size > 0) {
-        snprintf(key, sizeof(key), "%s/layer_order", prefix);
-        err = settings_save_one(key, slot->order_data, slot->order_size);
-        if (err != 0) {
-            report_save_err(sh, "layer order", err);
-            return err;
-        }
+    if (replaced.queued && replaced.cb != NULL) {
+        replaced.cb(-ECANCELED, replaced.user_data);
     }
 
-    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
-        if (slot->names_size[i] != 0) {
-            snprintf(key, sizeof(key), "%s/l_n/%d", prefix, i);
-            err = settings_save_one(key, slot->names_data[i], slot->names_size[i]);
-            if (err != 0) {
-                report_save_err(sh, "layer name", err);
-                return err;
-            }
-        }
+    k_work_submit_to_queue(&keymap_work_q, &request_work);
+}
 
-        const struct layer_bindings* layer_bindings = &slot->bindings[i];
-        for (uint16_t j = 0; j < layer_bindings->count; j++) {
-            snprintf(key, sizeof(key), "%s/l/%d/%d", prefix, i, layer_bindings->entries[j].index);
-            err = settings_save_one(key, layer_bindings->entries[j].data, layer_bindings->entries[j].length);
-            if (err != 0) {
-                report_save_err(sh, "layer binding", err);
-                return err;
-            }
-        }
+int keymap_shell_request_slot(const int slot_idx, const enum keymap_shell_source source,
+                              const keymap_shell_request_cb cb, void *user_data) {
+    if (slot_idx != KEYMAP_SHELL_REQUEST_RESTORE && (slot_idx < 0 || slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS)) {
+        return -EINVAL;
+    }
+
+    queue_request(&(struct activation_request){
+        .slot_idx = slot_idx,
+        .source = source,
+        .cb = cb,
+        .user_data = user_data,
+        .queued = true,
+    });
+    return 0;
+}
+
+int keymap_shell_request_slot_id(const uint16_t id, const enum keymap_shell_source source,
+                                 const keymap_shell_request_cb cb, void *user_data) {
+    if (id == 0) {
+        return -EINVAL;
     }
 
+    queue_request(&(struct activation_request){
+        .slot_id = id,
+        .source = source,
+        .cb = cb,
+        .user_data = user_data,
+        .queued = true,
+    });
     return 0;
 }
 
+/* Waits for queued activations and persists, so shell commands see settled state. */
+static void flush_pending_work(void) {
+    struct k_work_sync sync;
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_PREFETCH)
+    /* The shell works on the same state; whatever wasn't prefetched yet is read when used. */
+    k_work_cancel_sync(&prefetch_work, &sync);
+#endif
+    k_work_flush(&recover_work, &sync);
+    k_work_flush(&request_work, &sync);
+    flush_pending_persist();
+}
+
+/* Runs a shell command on settled state, holding state_lock throughout. */
+static int run_locked(const shell_cmd_handler handler, const struct shell *sh, const size_t argc, char **argv) {
+    flush_pending_work();
+    state_lock_take();
+    const int err = handler(sh, argc, argv);
+    state_lock_give();
+    return err;
+}
+
+#define LOCKED_CMD(handler)                                                                       \
+    static int handler##_locked(const struct shell *sh, const size_t argc, char **argv) {         \
+        return run_locked(handler, sh, argc, argv);                                               \
+    }
+
 static int cmd_destroy(const struct shell *sh, const size_t argc, char **argv) {
     if (!config.initialized) {
         shprint(sh, "Not initialized!");
@@ -451,13 +3647,13 @@ static int cmd_destroy(const struct shell *sh, const size_t argc, char **argv) {
         return -EINVAL;
     }
 
-    char key[16];
-    snprintf(key, sizeof(key), "slots/%d", slot_idx);
-    clear_slot(key);
+    erase_slot(slot_idx);
+    settings_commit();
 
     shprint(sh, "Destroyed.");
     return 0;
 }
+LOCKED_CMD(cmd_destroy)
 
 static int cmd_save(const struct shell *sh, const size_t argc, char **argv) {
     if (!config.initialized) {
@@ -492,64 +3688,75 @@ static int cmd_save(const struct shell *sh, const size_t argc, char **argv) {
         return -EEXIST;
     }
 
+    sync_system_overrides();
     if (config.system.is_free) {
         shprint(sh, "No overrides found.");
         shprint(sh, "Make changes with ZMK Studio first.");
         return -ENOTSUP;
     }
 
-    char key[MIN(CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX + 10, 20)];
-    snprintf(key, sizeof(key), "slots/%d", slot_idx);
-    clear_slot(key);
-
-    snprintf(key, sizeof(key), "slots/%d/_name", slot_idx);
-    int err = settings_save_one(key, argv[2], strlen(argv[2]));
-    if (err != 0) {
-        shprint(sh, "Failed to save slot name! Error code = %d", err);
-        return err;
+    const char *name = argv[2];
+    if (strlen(name) >= CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX) {
+        shprint(sh, "Slot name too long (max %d).", CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX - 1);
+        return -ENAMETOOLONG;
     }
 
-    char prefix[16];
-    snprintf(prefix, sizeof(prefix), "slots/%d", slot_idx);
-    err = save_slot_payload(prefix, &config.system, sh);
+    uint8_t flags = 0;
+    uint8_t bistable_slot = 0;
+#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
+    flags |= SLOT_BLOB_F_BISTABLE;
+    bistable_slot = zbs_get_slot();
+#endif
+
+    struct slot_meta *meta = &config.slots[slot_idx];
+    const int err = store_slot(slot_idx, &config.system, name, flags, bistable_slot, sh);
     if (err != 0) {
         return err;
     }
 
-#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-    const uint8_t bistable_slot = zbs_get_slot();
-    snprintf(key, sizeof(key), "slots/%d/bistable", slot_idx);
-    err = settings_save_one(key, &bistable_slot, sizeof(bistable_slot));
-    if (err != 0) {
-        shprint(sh, "Failed to save bistable slot! Error code = %d", err);
-        return err;
+    if (meta->legacy) {
+        clear_slot_legacy(slot_idx);
+        meta->legacy = false;
     }
-#endif
 
     settings_commit();
     shprint(sh, "Saved: slot %d (%s).", slot_idx + 1, argv[2]);
     return 0;
 }
+LOCKED_CMD(cmd_save)
 
 static int cmd_init(const struct shell *sh, const size_t argc, char **argv) {
     if (config.initialized) {
         shprint(sh, "Already initialized.");
-        return 0;
+    } else {
+        load_system(NULL);
     }
 
-    load_system(NULL);
+    maintain_storage();
     return 0;
 }
+LOCKED_CMD(cmd_init)
 
 static int cmd_status(const struct shell *sh, const size_t argc, char **argv) {
     bool verbose = false;
+    bool reload = false;
     for (int i = 0; i < argc; i++) {
         if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
             verbose = true;
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--reload") == 0) {
+            reload = true;
         }
     }
 
-    load_system(verbose ? sh : NULL);
+    if (reload || !loaded_state_current()) {
+        load_system(verbose ? sh : NULL);
+    } else {
+        refresh_system_state();
+        if (verbose) {
+            shprint(sh, "Nothing changed since the last read, use --reload to read storage anyway.");
+            shprint(sh, "");
+        }
+    }
     if (config.system.is_free) {
         shprint(sh, "No changes detected.");
         shprint(sh, "");
@@ -557,86 +3764,24 @@ static int cmd_status(const struct shell *sh, const size_t argc, char **argv) {
 
     bool found_active = false;
     for (int i = 0; i < CONFIG_ZMK_KEYMAP_SHELL_SLOTS; i++) {
-        const struct keymap_slot *slot = &config.slots[i];
-        if (slot == NULL) {
-            continue;
-        }
-
+        const struct slot_meta *slot = &config.slots[i];
         if (slot->is_free) {
             shprint(sh, "  Slot %d: unoccupied", i + 1);
         } else {
-            bool is_active = true;
-
-            if (config.system.order_size != slot->order_size) {
-                is_active = false;
-            } else if (config.system.order_size > 0 && 
-                       memcmp(config.system.order_data, slot->order_data, config.system.order_size) != 0) {
-                is_active = false;
-            }
-
-            if (is_active) {
-                for (int j = 0; j < ZMK_KEYMAP_LAYERS_LEN; j++) {
-                    if (config.system.names_size[j] != slot->names_size[j]) {
-                        is_active = false;
-                        break;
-                    }
-                    if (config.system.names_size[j] > 0 &&
-                        memcmp(config.system.names_data[j], slot->names_data[j], config.system.names_size[j]) != 0) {
-                        is_active = false;
-                        break;
-                    }
-                }
-            }
-
+            const bool is_active = slot_is_active(slot);
             if (is_active) {
-                for (int j = 0; j < ZMK_KEYMAP_LAYERS_LEN; j++) {
-                    const struct layer_bindings* sys_bindings = &config.system.bindings[j];
-                    const struct layer_bindings* slot_bindings = &slot->bindings[j];
-
-                    if (sys_bindings->count != slot_bindings->count) {
-                        is_active = false;
-                        break;
-                    }
-
-                    for (uint16_t k = 0; k < sys_bindings->count; k++) {
-                        const struct binding_entry* sys_entry = &sys_bindings->entries[k];
-                        
-                        const struct binding_entry* slot_entry = NULL;
-                        for (uint16_t m = 0; m < slot_bindings->count; m++) {
-                            if (slot_bindings->entries[m].index == sys_entry->index) {
-                                slot_entry = &slot_bindings->entries[m];
-                                break;
-                            }
-                        }
-                        
-                        if (slot_entry == NULL ||
-                            sys_entry->length != slot_entry->length ||
-                            memcmp(sys_entry->data, slot_entry->data, sys_entry->length) != 0) {
-                            is_active = false;
-                            break;
-                        }
-                    }
-
-                    if (!is_active) {
-                        break;
-                    }
-                }
+                found_active = true;
             }
 
-#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-            if (is_active) {
-                const uint8_t slot_bistable = slot->has_bistable ? slot->bistable_slot : ZBS_DEFAULT_SLOT;
-                if (zbs_get_slot() != slot_bistable) {
-                    is_active = false;
-                }
+            if (slot->raw_size != 0 && slot->raw_size != slot->size) {
+                shprint(sh, " %sSlot %d: %d bytes (%d uncompressed), name \"%s\"", is_active ? ">" : " ", i + 1,
+                        slot->size, slot->raw_size, slot->name[0] != '\0' ? slot->name : "(unnamed)");
+            } else {
+                shprint(sh, " %sSlot %d: %d bytes, name \"%s\"", is_active ? ">" : " ", i + 1, slot->size, slot->name[0] != '\0' ? slot->name : "(unnamed)");
             }
-#endif
-
-            if (is_active) {
-                found_active = true;
+            if (verbose) {
+                shprint(sh, "    fingerprint %08x", slot->fingerprint);
             }
-
-            shprint(sh, " %sSlot %d: %d bytes, name \"%s\"", is_active ? ">" : " ", i + 1, slot->total_size, slot->name ? slot->name : "(unnamed)");
         }
     }
 
@@ -647,19 +3792,11 @@ static int cmd_status(const struct shell *sh, const size_t argc, char **argv) {
 
     return 0;
 }
-
-void keymap_restore() {
-    clear_slot("keymap");
-    zmk_keymap_discard_changes();
-#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-    zbs_set_slot(ZBS_DEFAULT_SLOT);
-#endif
-#if IS_ENABLED(CONFIG_ZMK_ADAPTIVE_FEEDBACK)
-    zaf_custom_event_trigger(&ks_keymap_changed);
-#endif
-}
+LOCKED_CMD(cmd_status)
 
 static int cmd_restore(const struct shell *sh, const size_t argc, char **argv) {
+    flush_pending_work();
+    stats_count_activation(KEYMAP_SHELL_SOURCE_SHELL);
     keymap_restore();
     shprint(sh, "Restored.");
     return 0;
@@ -675,54 +3812,129 @@ static int cmd_free(const struct shell *sh, const size_t argc, char **argv) {
     shprint(sh, "Freed and uninitialized.");
     return 0;
 }
+LOCKED_CMD(cmd_free)
 
-int keymap_shell_activate_slot(const uint8_t slot_idx) {
-    if (slot_idx >= CONFIG_ZMK_KEYMAP_SHELL_SLOTS) {
-        return -EINVAL;
+static int cmd_cache(const struct shell *sh, const size_t argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        cache_clear();
+        config.cache.hits = 0;
+        config.cache.misses = 0;
+        config.cache.evictions = 0;
+        shprint(sh, "Cache cleared.");
+        return 0;
     }
 
-    if (!config.initialized) {
-        return -EBUSY;
+    shprint(sh, "Cache: %d of %d bytes", (int)cache_usage(), CONFIG_ZMK_KEYMAP_SHELL_CACHE_BYTES);
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        const struct payload_cache_entry *entry = &config.cache.entries[i];
+        if (entry->slot_idx >= 0) {
+            shprint(sh, "  Slot %d (%s): %d bytes", entry->slot_idx + 1, config.slots[entry->slot_idx].name,
+                    (int)entry->slot.arena.reserved);
+        }
     }
+    shprint(sh, "Hits: %u, misses: %u, evictions: %u", config.cache.hits, config.cache.misses, config.cache.evictions);
+    return 0;
+}
+LOCKED_CMD(cmd_cache)
 
-    if (config.slots[slot_idx].is_free) {
-        return -ENOENT;
+/* Bytes reserved by an arena but not handed out, the part of slot memory lost to chunking. */
+static size_t arena_slack(const struct slot_arena* arena) {
+    size_t slack = 0;
+    for (const struct arena_chunk* chunk = arena->head; chunk != NULL; chunk = chunk->next) {
+        slack += chunk->size - chunk->used;
+    }
+    return slack;
+}
+
+/* Free bytes and the largest free block, read off the heap's free lists rather than found by allocating. */
+static void heap_free_blocks(size_t *free_bytes, size_t *largest) {
+    struct z_heap *h = keymap_heap.heap.heap;
+    *free_bytes = 0;
+    *largest = 0;
+
+    const k_spinlock_key_t key = k_spin_lock(&keymap_heap.lock);
+    for (int b = 0; b < 32; b++) {
+        if ((h->avail_buckets & BIT(b)) == 0) {
+            continue;
+        }
+
+        const chunkid_t first = h->buckets[b].next;
+        chunkid_t c = first;
+        do {
+            const size_t bytes = chunksz_to_bytes(h, chunk_size(h, c)) - chunk_header_bytes(h);
+            *free_bytes += bytes;
+            *largest = MAX(*largest, bytes);
+            c = next_free_chunk(h, c);
+        } while (c != first);
     }
+    k_spin_unlock(&keymap_heap.lock, key);
+}
 
-    clear_slot("keymap");
+static int cmd_mem(const struct shell *sh, const size_t argc, char **argv) {
+#ifdef CONFIG_SYS_HEAP_RUNTIME_STATS
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        sys_heap_runtime_stats_reset_max(&keymap_heap.heap);
+        shprint(sh, "Peak reset.");
+        return 0;
+    }
 
-    const struct keymap_slot* slot = &config.slots[slot_idx];
-    const int err = save_slot_payload("keymap", slot, NULL);
+    struct sys_memory_stats heap_stats;
+    const int err = sys_heap_runtime_stats_get(&keymap_heap.heap, &heap_stats);
     if (err != 0) {
+        shprint(sh, "Failed to read heap statistics! Error code = %d", err);
         return err;
     }
 
-    settings_commit();
-    zmk_keymap_discard_changes();
+    shprint(sh, "Heap: %d of %d bytes used, peak %d", (int)heap_stats.allocated_bytes,
+            CONFIG_ZMK_KEYMAP_SHELL_HEAP_SIZE, (int)heap_stats.max_allocated_bytes);
+#else
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        shprint(sh, "The peak needs CONFIG_SYS_HEAP_RUNTIME_STATS.");
+        return 1;
+    }
 
-#if IS_ENABLED(CONFIG_ZMK_BISTABLE_BEHAVIOR)
-    zbs_set_slot(slot->has_bistable ? slot->bistable_slot : ZBS_DEFAULT_SLOT);
+    shprint(sh, "Heap: %d bytes", CONFIG_ZMK_KEYMAP_SHELL_HEAP_SIZE);
 #endif
 
-    LOG_INF("Slot %d (%s) successfully activated!", slot_idx + 1, slot->name);
-#if IS_ENABLED(CONFIG_ZMK_ADAPTIVE_FEEDBACK)
-    zaf_custom_event_trigger(&ks_keymap_changed);
-#endif
+    size_t free_bytes;
+    size_t largest;
+    heap_free_blocks(&free_bytes, &largest);
+    const int fragmentation = free_bytes > 0 ? 100 - (int)(largest * 100 / free_bytes) : 0;
+    shprint(sh, "Free: %d bytes, largest block %d bytes (%d%% fragmented)", (int)free_bytes, (int)largest,
+            fragmentation);
+
+    size_t cached = 0;
+    size_t slack = arena_slack(&config.system.arena);
+    for (int i = 0; i < PAYLOAD_CACHE_ENTRIES; i++) {
+        if (config.cache.entries[i].slot_idx >= 0) {
+            cached += config.cache.entries[i].slot.arena.reserved;
+            slack += arena_slack(&config.cache.entries[i].slot.arena);
+        }
+    }
+    shprint(sh, "Current keymap: %d bytes, cache: %d bytes", (int)config.system.arena.reserved, (int)cached);
+    shprint(sh, "Unused in slot chunks: %d bytes", (int)slack);
     return 0;
 }
+LOCKED_CMD(cmd_mem)
 
+/* Not run under state_lock as a whole: activations take it themselves, after dropping a queued persist. */
 static int cmd_activate(const struct shell *sh, const size_t argc, char **argv) {
-    if (!config.initialized) {
+    flush_pending_work();
+    state_lock_take();
+    const bool initialized = config.initialized;
+    state_lock_give();
+    if (!initialized) {
         shprint(sh, "Not initialized!");
         shprint(sh, "Use \"keymap init\" or \"keymap status\" first.");
         return 1;
     }
 
     if (argc <= 1) {
-        shprint(sh, "Usage: keymap activate [slot_index|slot_name]");
+        shprint(sh, "Usage: keymap activate [slot_index|slot_name] [--temp]");
         shprint(sh, "Example: ");
         shprint(sh, "  keymap activate 2");
         shprint(sh, "  keymap activate left_hand");
+        shprint(sh, "  keymap activate gaming --temp");
         return 0;
     }
 
@@ -732,32 +3944,345 @@ static int cmd_activate(const struct shell *sh, const size_t argc, char **argv)
         return -ENOENT;
     }
 
+    const bool temp = argc > 2 && (strcmp(argv[2], "-t") == 0 || strcmp(argv[2], "--temp") == 0);
     const uint8_t slot_idx = resolved;
-    const int err = keymap_shell_activate_slot(slot_idx);
+    stats_count_activation(KEYMAP_SHELL_SOURCE_SHELL);
+    const int err = temp ? keymap_shell_activate_slot_temp(slot_idx) : keymap_shell_activate_slot(slot_idx);
     if (err == -EINVAL) {
         shprint(sh, "Invalid slot!");
         return err;
     } else if (err == -ENOENT) {
         shprint(sh, "The slot is empty!");
         return err;
+    } else if (err == -ENOTSUP) {
+        shprint(sh, "This slot can't be applied without saving it.");
+        return err;
+    } else if (err == -EACCES) {
+        shprint(sh, "Lock ZMK Studio first, it could save the temporary keymap.");
+        return err;
+    } else if (err == -EBUSY) {
+        shprint(sh, "Not initialized!");
+        shprint(sh, "Use \"keymap init\" or \"keymap status\" first.");
+        return err;
     } else if (err != 0) {
         shprint(sh, "Failed to activate slot! Error code = %d", err);
         return err;
     }
 
-    shprint(sh, "Activated: slot %d (%s).", slot_idx + 1, config.slots[slot_idx].name);
+    char name[CONFIG_ZMK_KEYMAP_SHELL_SLOT_NAME_MAX];
+    if (!keymap_shell_slot_name(slot_idx, name, sizeof(name))) {
+        name[0] = '\0';
+    }
+    shprint(sh, "Activated%s: slot %d (%s).", temp ? " temporarily" : "", slot_idx + 1, name);
+    return 0;
+}
+
+struct diff_printer {
+    const struct shell *sh;
+    int16_t layer;
+    int count;
+};
+
+static void print_order(const struct shell *sh, const char *sign, const uint8_t *order, const uint8_t size) {
+    if (size == 0) {
+        shprint(sh, "  %s default", sign);
+        return;
+    }
+
+    char line[64];
+    int pos = 0;
+    for (uint8_t i = 0; i < size && pos < (int)sizeof(line) - 4; i++) {
+        pos += snprintf(line + pos, sizeof(line) - pos, " %d", order[i]);
+    }
+    shprint(sh, "  %s%s", sign, line);
+}
+
+static void print_binding(const struct shell *sh, const char *sign, const uint16_t index, const uint8_t *data,
+                          const uint8_t size) {
+    struct binding_setting setting = { 0 };
+    memcpy(&setting, data, MIN((size_t)size, sizeof(setting)));
+
+    const char *behavior = zmk_behavior_find_behavior_name_from_local_id(setting.behavior_local_id);
+    if (behavior != NULL) {
+        shprint(sh, "  %s %3d: %s 0x%x 0x%x", sign, index, behavior, setting.param1, setting.param2);
+    } else {
+        shprint(sh, "  %s %3d: #%d 0x%x 0x%x", sign, index, setting.behavior_local_id, setting.param1, setting.param2);
+    }
+}
+
+static int print_difference_cb(const struct slot_difference *difference, void *user_data) {
+    struct diff_printer *printer = user_data;
+    const struct shell *sh = printer->sh;
+    printer->count++;
+
+    if (difference->change == SLOT_CHANGE_ORDER) {
+        shprint(sh, "Layer order:");
+        print_order(sh, "-", difference->from, difference->from_size);
+        print_order(sh, "+", difference->to, difference->to_size);
+        return 0;
+    }
+
+    if (printer->layer != difference->layer) {
+        printer->layer = difference->layer;
+        shprint(sh, "Layer %d:", difference->layer);
+    }
+
+    switch (difference->change) {
+    case SLOT_CHANGE_NAME:
+        shprint(sh, "  name: %s%.*s%s -> %s%.*s%s", difference->from_size ? "\"" : "(default)",
+                difference->from_size, (const char *)difference->from, difference->from_size ? "\"" : "",
+                difference->to_size ? "\"" : "(default)", difference->to_size, (const char *)difference->to,
+                difference->to_size ? "\"" : "");
+        break;
+    case SLOT_CHANGE_ADDED:
+        print_binding(sh, "+", difference->index, difference->to, difference->to_size);
+        break;
+    case SLOT_CHANGE_REMOVED:
+        print_binding(sh, "-", difference->index, difference->from, difference->from_size);
+        break;
+    default:
+        print_binding(sh, "-", difference->index, difference->from, difference->from_size);
+        print_binding(sh, "+", difference->index, difference->to, difference->to_size);
+        break;
+    }
+    return 0;
+}
+
+#define SLOT_CURRENT INT16_MAX
+
+/*
+ * Builds the live keymap, unsaved ZMK Studio edits included, as the overrides ZMK would store for it:
+ * whatever differs from the firmware keymap. Stored records the live keymap still matches are reused
+ * as they are, so only actual edits show up against the stored overrides. Those records point into
+ * config.system, so the result is only good while the overrides aren't read again.
+ */
+static int load_live_keymap(struct keymap_slot *live) {
+    const struct keymap_slot *stored = &config.system;
+    memset(live, 0, sizeof(*live));
+
+    uint8_t order[ZMK_KEYMAP_LAYERS_LEN];
+    bool reordered = false;
+    for (int i = 0; i < ZMK_KEYMAP_LAYERS_LEN; i++) {
+        order[i] = zmk_keymap_layer_index_to_id(i);
+        reordered = reordered || order[i] != i;
+    }
+
+    if (blob_equals(stored->order_data, stored->order_size, order, sizeof(order))) {
+        live->order_data = stored->order_data;
+        live->order_size = stored->order_size;
+    } else if (reordered || stored->order_size > 0) {
+        live->order_data = arena_alloc(&live->arena, sizeof(order));
+        if (live->order_data == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(live->order_data, order, sizeof(order));
+        live->order_size = sizeof(order);
+    }
+
+    for (uint8_t layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        const char *name = zmk_keymap_layer_name(layer);
+        name = name != NULL ? name : "";
+        const size_t name_size = MIN(strlen(name), UINT8_MAX);
+        const char *stock_name = stock_layer_names[layer] != NULL ? stock_layer_names[layer] : "";
+
+        uint8_t stored_size;
+        const uint8_t *stored_name = slot_layer_name_data(stored, layer, &stored_size);
+        uint8_t *name_data = NULL;
+        if (stored_size > 0 && blob_equals(stored_name, stored_size, (const uint8_t *)name, name_size)) {
+            name_data = (uint8_t *)stored_name;
+        } else if (strlen(stock_name) != name_size || memcmp(stock_name, name, name_size) != 0) {
+            name_data = arena_alloc(&live->arena, name_size);
+            if (name_data == NULL) {
+                return -ENOMEM;
+            }
+            memcpy(name_data, name, name_size);
+        }
+
+        if (name_data != NULL) {
+            struct layer_name *entry = slot_put_layer_name(live, layer);
+            if (entry == NULL) {
+                return -ENOMEM;
+            }
+            entry->data = name_data;
+            entry->length = name_size;
+        }
+
+        const struct layer_bindings overrides = slot_layer_bindings(stored, layer);
+        uint16_t next = 0;
+        for (uint16_t pos = 0; pos < ZMK_KEYMAP_LEN; pos++) {
+            const struct zmk_behavior_binding *binding = zmk_keymap_get_layer_binding_at_idx(layer, pos);
+            if (binding == NULL) {
+                continue;
+            }
+
+            while (next < overrides.count && overrides.entries[next].index < pos) {
+                next++;
+            }
+            const struct binding_entry *override =
+                next < overrides.count && overrides.entries[next].index == pos ? &overrides.entries[next] : NULL;
+
+            struct zmk_behavior_binding stored_binding;
+            uint8_t *data;
+            uint8_t length;
+            if (override != NULL && decode_binding(override, &stored_binding) == 0 &&
+                binding_matches(&stored_binding, binding)) {
+                data = override->data;
+                length = override->length;
+            } else if (binding_matches(binding, &stock_keymap[layer][pos])) {
+                continue;
+            } else {
+                const struct binding_setting setting = {
+                    .behavior_local_id = zmk_behavior_get_local_id(binding->behavior_dev),
+                    .param1 = binding->param1,
+                    .param2 = binding->param2,
+                };
+                data = arena_alloc(&live->arena, sizeof(setting));
+                if (data == NULL) {
+                    return -ENOMEM;
+                }
+                memcpy(data, &setting, sizeof(setting));
+                length = sizeof(setting);
+            }
+
+            struct binding_entry *entry = slot_put_binding(live, layer, pos);
+            if (entry == NULL) {
+                return -ENOMEM;
+            }
+            entry->data = data;
+            entry->length = length;
+        }
+    }
+
+    live->fingerprint = slot_fingerprint(live);
+    return 0;
+}
+
+/* Resolves a diff operand to a slot index, or SLOT_CURRENT for the live keymap. */
+static int resolve_diff_side(const struct shell *sh, const char *arg) {
+    if (strcmp(arg, "current") == 0) {
+        return SLOT_CURRENT;
+    }
+
+    const int resolved = keymap_shell_resolve_slot(arg);
+    if (resolved < 0) {
+        shprint(sh, "Slot not found: %s", arg);
+        return -ENOENT;
+    }
+    if (config.slots[resolved].is_free) {
+        shprint(sh, "Slot %d is empty!", resolved + 1);
+        return -ENOENT;
+    }
+    return resolved;
+}
+
+static const struct keymap_slot *load_diff_side(const int side, const struct keymap_slot *live) {
+    return side == SLOT_CURRENT ? live : load_slot_payload(side);
+}
+
+static int cmd_diff(const struct shell *sh, const size_t argc, char **argv) {
+    if (!config.initialized) {
+        shprint(sh, "Not initialized!");
+        shprint(sh, "Use \"keymap init\" or \"keymap status\" first.");
+        return 1;
+    }
+
+    if (argc != 3) {
+        shprint(sh, "Usage: keymap diff [slot_index|slot_name|current] [slot_index|slot_name|current]");
+        shprint(sh, "Example: ");
+        shprint(sh, "  keymap diff 1 2");
+        shprint(sh, "  keymap diff gaming current");
+        return 0;
+    }
+
+    const int from = resolve_diff_side(sh, argv[1]);
+    const int to = resolve_diff_side(sh, argv[2]);
+    if (from < 0 || to < 0) {
+        return -ENOENT;
+    }
+
+    struct keymap_slot live = { 0 };
+    if (from == SLOT_CURRENT || to == SLOT_CURRENT) {
+        sync_system_overrides();
+        if (load_live_keymap(&live) != 0) {
+            free_slot(&live);
+            shprint(sh, "Failed to read the live keymap!");
+            return -ENOMEM;
+        }
+    }
+
+    /* The first payload has to survive loading the second one. */
+    config.cache.pinned = from == SLOT_CURRENT ? -1 : from;
+    const struct keymap_slot *a = load_diff_side(from, &live);
+    const struct keymap_slot *b = a != NULL ? load_diff_side(to, &live) : NULL;
+    config.cache.pinned = -1;
+    if (a == NULL || b == NULL) {
+        free_slot(&live);
+        shprint(sh, "Failed to load slot data!");
+        return -EIO;
+    }
+
+    struct diff_printer printer = { .sh = sh, .layer = -1 };
+    slot_compare(a, b, print_difference_cb, &printer);
+    free_slot(&live);
+    if (printer.count == 0) {
+        shprint(sh, "No differences.");
+    } else {
+        shprint(sh, "%d difference%s.", printer.count, printer.count == 1 ? "" : "s");
+    }
+    return 0;
+}
+LOCKED_CMD(cmd_diff)
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SHELL_STATS)
+static int cmd_stats(const struct shell *sh, const size_t argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        memset(&stats, 0, sizeof(stats));
+        memset(&usage, 0, sizeof(usage));
+        shprint(sh, "Counters reset.");
+        return 0;
+    }
+
+    static const char *const op_names[STATS_OPS] = { "load", "save", "clear", "activate", "restore" };
+    shprint(sh, "%-9s %6s %9s %9s %9s", "op", "count", "min us", "avg us", "max us");
+    for (int i = 0; i < STATS_OPS; i++) {
+        const struct op_timing *timing = &stats.ops[i];
+        if (timing->count == 0) {
+            shprint(sh, "%-9s %6u %9s %9s %9s", op_names[i], 0, "-", "-", "-");
+            continue;
+        }
+
+        shprint(sh, "%-9s %6u %9u %9u %9u", op_names[i], timing->count,
+                (uint32_t)k_cyc_to_us_floor64(timing->min_cycles),
+                (uint32_t)k_cyc_to_us_floor64(timing->total_cycles / timing->count),
+                (uint32_t)k_cyc_to_us_floor64(timing->max_cycles));
+    }
+
+    shprint(sh, "Storage: %u bytes read, %u bytes written", (uint32_t)usage.bytes_read, (uint32_t)usage.bytes_written);
+    shprint(sh, "Keys: %u written, %u deleted, %u scanned in %u walks", usage.saves, usage.deletes, usage.records,
+            usage.walks);
+    shprint(sh, "Activations: %u from shell, %u from &skmp, %u from output assignment",
+            stats.activations[KEYMAP_SHELL_SOURCE_SHELL], stats.activations[KEYMAP_SHELL_SOURCE_BEHAVIOR],
+            stats.activations[KEYMAP_SHELL_SOURCE_OUTPUT]);
     return 0;
 }
+LOCKED_CMD(cmd_stats)
+#endif
 
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_keymap,
-    SHELL_CMD(init, NULL, "Initialize interactive slots subsystem.", cmd_init),
-    SHELL_CMD(status, NULL, "Print status of all slots.", cmd_status),
-    SHELL_CMD(save, NULL, "Save current keymap to a slot.", cmd_save),
-    SHELL_CMD(overwrite, NULL, "Overwrite slot with the current keymap.", cmd_save),
+    SHELL_CMD(init, NULL, "Initialize interactive slots subsystem.", cmd_init_locked),
+    SHELL_CMD(status, NULL, "Print status of all slots (--reload to re-read storage).", cmd_status_locked),
+    SHELL_CMD(save, NULL, "Save current keymap to a slot.", cmd_save_locked),
+    SHELL_CMD(overwrite, NULL, "Overwrite slot with the current keymap.", cmd_save_locked),
     SHELL_CMD(activate, NULL, "Activate a saved slot by index or name.", cmd_activate),
-    SHELL_CMD(destroy, NULL, "Delete the slot and its data.", cmd_destroy),
+    SHELL_CMD(diff, NULL, "Compare two slots, or a slot and the \"current\" live keymap.", cmd_diff_locked),
+    SHELL_CMD(destroy, NULL, "Delete the slot and its data.", cmd_destroy_locked),
     SHELL_CMD(restore, NULL, "Restore the factory default keymap.", cmd_restore),
-    SHELL_CMD(free, NULL, "Free all allocated memory and uninitialize.", cmd_free),
+    SHELL_CMD(free, NULL, "Free all allocated memory and uninitialize.", cmd_free_locked),
+    SHELL_CMD(cache, NULL, "Show or clear cached slots (keymap cache [clear]).", cmd_cache_locked),
+    SHELL_CMD(mem, NULL, "Show memory use (keymap mem [reset]).", cmd_mem_locked),
+    SHELL_COND_CMD(CONFIG_ZMK_KEYMAP_SHELL_STATS, stats, NULL,
+                   "Show or reset performance counters (keymap stats [reset]).",
+                   COND_CODE_1(CONFIG_ZMK_KEYMAP_SHELL_STATS, (cmd_stats_locked), (NULL))),
     SHELL_COND_CMD(CONFIG_ZMK_KEYMAP_OUTPUT_ASSIGN, assign, NULL,
                    "Bind an output to a keymap slot.", keymap_assign_cmd),
     SHELL_SUBCMD_SET_END
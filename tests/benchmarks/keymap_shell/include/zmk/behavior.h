@@ -0,0 +1,15 @@
+/* Stand-in for ZMK's behavior API, as far as the keymap shell uses it. */
+#pragma once
+
+#include <stdint.h>
+
+typedef uint16_t zmk_behavior_local_id_t;
+
+struct zmk_behavior_binding {
+    const char *behavior_dev;
+    uint32_t param1;
+    uint32_t param2;
+};
+
+zmk_behavior_local_id_t zmk_behavior_get_local_id(const char *name);
+const char *zmk_behavior_find_behavior_name_from_local_id(zmk_behavior_local_id_t local_id);
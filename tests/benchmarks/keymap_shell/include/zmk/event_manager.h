@@ -0,0 +1,6 @@
+/* Stand-in for ZMK's event manager. The benchmark builds without ZMK Studio, so no events reach the shell. */
+#pragma once
+
+typedef struct zmk_event_t zmk_event_t;
+
+#define ZMK_EV_EVENT_BUBBLE 0
@@ -0,0 +1,27 @@
+/* Stand-in for ZMK's keymap API, as far as the keymap shell uses it. */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zmk/behavior.h>
+
+#define ZMK_KEYMAP_LAYERS_LEN CONFIG_BENCHMARK_LAYERS
+#define ZMK_KEYMAP_LAYER_ID_INVAL UINT8_MAX
+
+typedef uint8_t zmk_keymap_layer_id_t;
+typedef uint8_t zmk_keymap_layer_index_t;
+
+zmk_keymap_layer_id_t zmk_keymap_layer_index_to_id(zmk_keymap_layer_index_t layer_index);
+const char *zmk_keymap_layer_name(zmk_keymap_layer_id_t layer_id);
+int zmk_keymap_set_layer_name(zmk_keymap_layer_id_t layer_id, const char *name, size_t size);
+int zmk_keymap_move_layer(zmk_keymap_layer_index_t start_idx, zmk_keymap_layer_index_t dest_idx);
+
+const struct zmk_behavior_binding *zmk_keymap_get_layer_binding_at_idx(zmk_keymap_layer_id_t layer_id,
+                                                                       uint8_t binding_idx);
+int zmk_keymap_set_layer_binding_at_idx(zmk_keymap_layer_id_t layer_id, uint8_t binding_idx,
+                                        const struct zmk_behavior_binding binding);
+
+bool zmk_keymap_check_unsaved_changes(void);
+int zmk_keymap_save_changes(void);
+int zmk_keymap_discard_changes(void);
@@ -0,0 +1,4 @@
+/* Stand-in for ZMK's matrix definitions: the synthetic keymap's size. */
+#pragma once
+
+#define ZMK_KEYMAP_LEN CONFIG_BENCHMARK_KEYS
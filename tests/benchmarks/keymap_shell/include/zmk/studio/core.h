@@ -0,0 +1,9 @@
+/* Stand-in for ZMK Studio's lock state; the benchmark keeps Studio unlocked. */
+#pragma once
+
+enum zmk_studio_core_lock_state {
+    ZMK_STUDIO_CORE_LOCK_STATE_LOCKED = 0,
+    ZMK_STUDIO_CORE_LOCK_STATE_UNLOCKED = 1,
+};
+
+enum zmk_studio_core_lock_state zmk_studio_core_get_lock_state(void);
@@ -0,0 +1,7 @@
+/* Host CPU time for the benchmark, from src/host_clock.c in the native simulator's runner. */
+#pragma once
+
+#include <stdint.h>
+
+/* CPU time the host process has used so far, in microseconds. */
+uint64_t bench_host_cpu_us(void);
@@ -0,0 +1,301 @@
+/*
+ * Keymap shell benchmark for native_sim. Slots of a synthetic keymap are saved, overwritten, loaded,
+ * listed, activated, restored and destroyed through the shell, with 4, 16 and 64 slots in storage, and
+ * each operation reports its time, flash simulator calls and peak slot memory. Destroying slots stored
+ * one record per binding, as older versions did, is measured separately.
+ *
+ * Two times are reported. "us" is simulated: the flash simulator's read, write and erase timing and
+ * nothing else, so runs are repeatable and show what a change does to storage traffic on either
+ * settings backend. "cpu us" is the host CPU time the command took, which is where encoding,
+ * compression and lookups show up; it varies between hosts and runs.
+ *
+ * Commands that only read fail the benchmark if they write or erase flash at all, and the others if
+ * they exceed CONFIG_BENCHMARK_FLASH_WRITES_PER_OVERRIDE or CONFIG_BENCHMARK_FLASH_ERASES_MAX.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/shell/shell_dummy.h>
+#include <zephyr/stats/stats.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/ztest.h>
+#include <zmk/keymap.h>
+#include <zmk/matrix.h>
+
+#include "host_clock.h"
+
+enum bench_op {
+    BENCH_SAVE,
+    BENCH_OVERWRITE,
+    BENCH_LOAD,
+    BENCH_STATUS,
+    BENCH_ACTIVATE,
+    BENCH_RESTORE,
+    BENCH_CLEAR,
+    BENCH_CLEAR_LEGACY,
+    BENCH_OPS,
+};
+
+static const char *const bench_op_names[BENCH_OPS] = {
+    "save", "overwrite", "load", "status", "activate", "restore", "clear", "clear old",
+};
+static const bool bench_op_read_only[BENCH_OPS] = { [BENCH_LOAD] = true, [BENCH_STATUS] = true };
+
+#define BENCH_OVERRIDES (ZMK_KEYMAP_LAYERS_LEN * MIN(CONFIG_BENCHMARK_OVERRIDES, ZMK_KEYMAP_LEN))
+
+/* Slots stored the old way are large; a few are enough to time destroying them. */
+#define BENCH_LEGACY_SLOTS 4
+
+/* Same layout as ZMK's stored binding record, which old slots kept one of per binding. */
+struct bench_binding_setting {
+    zmk_behavior_local_id_t behavior_local_id;
+    uint32_t param1;
+    uint32_t param2;
+} __packed;
+
+struct flash_counts {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t erases;
+};
+
+struct bench_result {
+    uint32_t runs;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint64_t total_cpu_us;
+    struct flash_counts flash;
+    uint32_t heap_peak;
+};
+
+static const struct shell *sh;
+
+static int flash_stat_cb(struct stats_hdr *hdr, void *arg, const char *name, const uint16_t off) {
+    struct flash_counts *counts = arg;
+    const uint32_t value = *(const uint32_t *)((const uint8_t *)hdr + off);
+
+    if (strcmp(name, "flash_read_calls") == 0) {
+        counts->reads = value;
+    } else if (strcmp(name, "flash_write_calls") == 0) {
+        counts->writes = value;
+    } else if (strcmp(name, "flash_erase_calls") == 0) {
+        counts->erases = value;
+    }
+    return 0;
+}
+
+static void flash_counts_get(struct flash_counts *counts) {
+    struct stats_hdr *hdr = stats_group_find("flash_sim_stats");
+    zassert_not_null(hdr, "Flash simulator statistics are missing");
+    stats_walk(hdr, flash_stat_cb, counts);
+}
+
+static int run_cmd(const char *cmd) {
+    shell_backend_dummy_clear_output(sh);
+    return shell_execute_cmd(sh, cmd);
+}
+
+/* Peak slot memory since the last "keymap mem reset", from "keymap mem". */
+static uint32_t heap_peak_get(void) {
+    zassert_ok(run_cmd("keymap mem"));
+
+    size_t size;
+    const char *output = shell_backend_dummy_get_output(sh, &size);
+    const char *peak = strstr(output, "peak ");
+    zassert_not_null(peak, "No heap statistics in \"%s\"", output);
+    return strtoul(peak + strlen("peak "), NULL, 10);
+}
+
+/* Fails the benchmark if a command took more flash writes or erases than its operation may. */
+static void bench_check_flash(const enum bench_op op, const char *cmd, const struct flash_counts *flash) {
+    if (bench_op_read_only[op]) {
+        zassert_equal(flash->writes, 0, "\"%s\" wrote flash %u times", cmd, flash->writes);
+        zassert_equal(flash->erases, 0, "\"%s\" erased flash %u times", cmd, flash->erases);
+        return;
+    }
+
+    const uint32_t max_writes = CONFIG_BENCHMARK_FLASH_WRITES_PER_OVERRIDE * BENCH_OVERRIDES;
+    zassert_true(flash->writes <= max_writes, "\"%s\" wrote flash %u times, limit %u", cmd, flash->writes,
+                 max_writes);
+    zassert_true(flash->erases <= CONFIG_BENCHMARK_FLASH_ERASES_MAX, "\"%s\" erased flash %u times, limit %u",
+                 cmd, flash->erases, CONFIG_BENCHMARK_FLASH_ERASES_MAX);
+}
+
+/* Runs one shell command and adds its cost to the results of op. */
+static void bench_cmd(struct bench_result *results, const enum bench_op op, const char *fmt, ...) {
+    struct bench_result *result = &results[op];
+    char cmd[48];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, args);
+    va_end(args);
+
+    zassert_ok(run_cmd("keymap mem reset"));
+    struct flash_counts before;
+    struct flash_counts after;
+    flash_counts_get(&before);
+
+    shell_backend_dummy_clear_output(sh);
+    const uint64_t cpu_start = bench_host_cpu_us();
+    const uint32_t start = k_cycle_get_32();
+    const int err = shell_execute_cmd(sh, cmd);
+    const uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    const uint64_t cpu_us = bench_host_cpu_us() - cpu_start;
+
+    flash_counts_get(&after);
+    zassert_ok(err, "\"%s\" failed: %d", cmd, err);
+
+    const struct flash_counts flash = {
+        .reads = after.reads - before.reads,
+        .writes = after.writes - before.writes,
+        .erases = after.erases - before.erases,
+    };
+    bench_check_flash(op, cmd, &flash);
+
+    result->min_us = result->runs == 0 ? us : MIN(result->min_us, us);
+    result->max_us = MAX(result->max_us, us);
+    result->total_us += us;
+    result->total_cpu_us += cpu_us;
+    result->runs++;
+    result->flash.reads += flash.reads;
+    result->flash.writes += flash.writes;
+    result->flash.erases += flash.erases;
+    result->heap_peak = MAX(result->heap_peak, heap_peak_get());
+}
+
+/* Stores a keymap that overrides the same bindings as every other seed, with different values. */
+static void bench_keymap_store(const uint8_t seed) {
+    for (uint8_t layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (uint8_t position = 0; position < MIN(CONFIG_BENCHMARK_OVERRIDES, ZMK_KEYMAP_LEN); position++) {
+            const struct zmk_behavior_binding binding = {
+                .behavior_dev = "key_press",
+                .param1 = 0x80000 + (seed * ZMK_KEYMAP_LAYERS_LEN + layer) * ZMK_KEYMAP_LEN + position,
+            };
+            zassert_ok(zmk_keymap_set_layer_binding_at_idx(layer, position, binding));
+        }
+    }
+    zassert_ok(zmk_keymap_save_changes());
+}
+
+/* Writes a slot the way older versions stored it: its name and one record per overridden binding. */
+static void bench_legacy_slot_store(const uint8_t slot_idx, const uint8_t seed) {
+    char key[32];
+    char name[16];
+    snprintf(key, sizeof(key), "slots/%d/_name", slot_idx);
+    snprintf(name, sizeof(name), "old%d", slot_idx + 1);
+    zassert_ok(settings_save_one(key, name, strlen(name)));
+
+    for (uint8_t layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (uint8_t position = 0; position < MIN(CONFIG_BENCHMARK_OVERRIDES, ZMK_KEYMAP_LEN); position++) {
+            const struct bench_binding_setting setting = {
+                .behavior_local_id = zmk_behavior_get_local_id("key_press"),
+                .param1 = 0x80000 + (seed * ZMK_KEYMAP_LAYERS_LEN + layer) * ZMK_KEYMAP_LEN + position,
+            };
+            snprintf(key, sizeof(key), "slots/%d/l/%d/%d", slot_idx, layer, position);
+            zassert_ok(settings_save_one(key, &setting, sizeof(setting)));
+        }
+    }
+}
+
+static void bench_print(const uint8_t slots, const struct bench_result *results) {
+    TC_PRINT("%s, %d slots of %d layers x %d overrides\n", IS_ENABLED(CONFIG_SETTINGS_ZMS) ? "ZMS" : "NVS", slots,
+             ZMK_KEYMAP_LAYERS_LEN, MIN(CONFIG_BENCHMARK_OVERRIDES, ZMK_KEYMAP_LEN));
+    TC_PRINT("%-9s %5s %9s %9s %9s %9s %7s %7s %7s %9s\n", "op", "runs", "min us", "avg us", "max us", "cpu us",
+             "reads", "writes", "erases", "heap peak");
+    for (int i = 0; i < BENCH_OPS; i++) {
+        const struct bench_result *result = &results[i];
+        if (result->runs == 0) {
+            continue;
+        }
+
+        TC_PRINT("%-9s %5u %9u %9u %9u %9u %7u %7u %7u %9u\n", bench_op_names[i], result->runs, result->min_us,
+                 (uint32_t)(result->total_us / result->runs), result->max_us,
+                 (uint32_t)(result->total_cpu_us / result->runs), result->flash.reads / result->runs,
+                 result->flash.writes / result->runs, result->flash.erases / result->runs, result->heap_peak);
+    }
+}
+
+/*
+ * Saves that many synthetic slots and overwrites each with the next one's keymap, reloads them from
+ * storage, activates each, restores the stock keymap and destroys them again, then does the same for
+ * a few slots in the old per-binding layout, so no slots are left behind. Reads, writes and erases
+ * are per run.
+ */
+static void bench_slots(const uint8_t slots) {
+    struct bench_result results[BENCH_OPS] = { 0 };
+
+    zassert_true(slots <= CONFIG_ZMK_KEYMAP_SHELL_SLOTS);
+    zassert_ok(run_cmd("keymap status --reload"));
+
+    for (uint8_t i = 0; i < slots; i++) {
+        bench_keymap_store(i);
+        bench_cmd(results, BENCH_SAVE, "keymap save %d bench%d", i + 1, i + 1);
+    }
+    for (uint8_t i = 0; i < slots; i++) {
+        bench_keymap_store(i + 1);
+        bench_cmd(results, BENCH_OVERWRITE, "keymap overwrite %d bench%d", i + 1, i + 1);
+    }
+
+    zassert_ok(run_cmd("keymap free"));
+    bench_cmd(results, BENCH_LOAD, "keymap init");
+    bench_cmd(results, BENCH_STATUS, "keymap status");
+
+    for (uint8_t i = 0; i < slots; i++) {
+        bench_cmd(results, BENCH_ACTIVATE, "keymap activate %d", i + 1);
+    }
+    bench_cmd(results, BENCH_RESTORE, "keymap restore");
+
+    for (uint8_t i = 0; i < slots; i++) {
+        bench_cmd(results, BENCH_CLEAR, "keymap destroy %d", i + 1);
+    }
+
+    /* Old slots are converted once per boot in the background; let that pass before storing them, so
+     * they are destroyed as written. */
+    k_msleep(100);
+    zassert_ok(run_cmd("keymap free"));
+    for (uint8_t i = 0; i < MIN(slots, BENCH_LEGACY_SLOTS); i++) {
+        bench_legacy_slot_store(i, i);
+    }
+    zassert_ok(run_cmd("keymap status"));
+    for (uint8_t i = 0; i < MIN(slots, BENCH_LEGACY_SLOTS); i++) {
+        bench_cmd(results, BENCH_CLEAR_LEGACY, "keymap destroy %d", i + 1);
+    }
+
+    zassert_not_ok(run_cmd("keymap activate 1"), "Slots are left after the benchmark");
+    bench_print(slots, results);
+}
+
+static void *bench_setup(void) {
+    const struct flash_area *area;
+    zassert_ok(flash_area_open(FIXED_PARTITION_ID(storage_partition), &area));
+    zassert_ok(flash_area_erase(area, 0, area->fa_size));
+    flash_area_close(area);
+
+    zassert_ok(settings_subsys_init());
+    zassert_ok(settings_load());
+    zassert_ok(zmk_keymap_discard_changes());
+
+    sh = shell_backend_dummy_get_ptr();
+    WAIT_FOR(shell_ready(sh), 20000, k_msleep(1));
+    zassert_true(shell_ready(sh), "Timed out waiting for the dummy shell backend");
+    return NULL;
+}
+
+ZTEST(keymap_shell_bench, test_slots_04) {
+    bench_slots(4);
+}
+
+ZTEST(keymap_shell_bench, test_slots_16) {
+    bench_slots(16);
+}
+
+ZTEST(keymap_shell_bench, test_slots_64) {
+    bench_slots(64);
+}
+
+ZTEST_SUITE(keymap_shell_bench, NULL, bench_setup, NULL, NULL, NULL);
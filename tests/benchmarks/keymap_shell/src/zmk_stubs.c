@@ -0,0 +1,172 @@
+/*
+ * The parts of ZMK the keymap shell needs, for the benchmark: an in-memory keymap whose changes are
+ * stored like ZMK stores them, one "keymap/l/<layer>/<position>" record per overridden binding.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zmk/keymap.h>
+#include <zmk/matrix.h>
+#include <zmk/studio/core.h>
+
+LOG_MODULE_REGISTER(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+/* Local IDs are indices into this table; 0 is no behavior. */
+static const char *const behaviors[] = { NULL, "key_press", "momentary_layer", "transparent" };
+
+/* Same layout as ZMK's stored binding record. */
+struct binding_setting {
+    zmk_behavior_local_id_t behavior_local_id;
+    uint32_t param1;
+    uint32_t param2;
+} __packed;
+
+static struct zmk_behavior_binding bindings[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN];
+static bool changed[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN];
+static bool unsaved;
+static bool loaded;
+
+zmk_behavior_local_id_t zmk_behavior_get_local_id(const char *name) {
+    for (size_t i = 1; i < ARRAY_SIZE(behaviors); i++) {
+        if (strcmp(behaviors[i], name) == 0) {
+            return i;
+        }
+    }
+    return UINT16_MAX;
+}
+
+const char *zmk_behavior_find_behavior_name_from_local_id(const zmk_behavior_local_id_t local_id) {
+    return local_id < ARRAY_SIZE(behaviors) ? behaviors[local_id] : NULL;
+}
+
+enum zmk_studio_core_lock_state zmk_studio_core_get_lock_state(void) {
+    return ZMK_STUDIO_CORE_LOCK_STATE_UNLOCKED;
+}
+
+static struct zmk_behavior_binding stock_binding(const uint8_t layer, const uint8_t position) {
+    const struct zmk_behavior_binding binding = {
+        .behavior_dev = behaviors[1],
+        .param1 = 0x70000 + layer * ZMK_KEYMAP_LEN + position,
+    };
+    return binding;
+}
+
+static int load_binding_cb(const char *key, const size_t len, const settings_read_cb read_cb, void *cb_arg,
+                           void *param) {
+    if (strncmp(key, "l/", 2) != 0) {
+        return 0;
+    }
+
+    char *end;
+    const unsigned long layer = strtoul(&key[2], &end, 10);
+    if (*end != '/' || layer >= ZMK_KEYMAP_LAYERS_LEN) {
+        return 0;
+    }
+    const unsigned long position = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || position >= ZMK_KEYMAP_LEN) {
+        return 0;
+    }
+
+    /* Trailing zero params may be left out. */
+    struct binding_setting setting = { 0 };
+    if (read_cb(cb_arg, &setting, MIN(len, sizeof(setting))) < 0) {
+        return 0;
+    }
+
+    bindings[layer][position].behavior_dev = zmk_behavior_find_behavior_name_from_local_id(setting.behavior_local_id);
+    bindings[layer][position].param1 = setting.param1;
+    bindings[layer][position].param2 = setting.param2;
+    return 0;
+}
+
+int zmk_keymap_discard_changes(void) {
+    for (uint8_t layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (uint8_t position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            bindings[layer][position] = stock_binding(layer, position);
+        }
+    }
+    memset(changed, 0, sizeof(changed));
+    unsaved = false;
+    loaded = true;
+
+    return settings_load_subtree_direct("keymap", load_binding_cb, NULL);
+}
+
+static void ensure_loaded(void) {
+    if (!loaded) {
+        zmk_keymap_discard_changes();
+    }
+}
+
+int zmk_keymap_save_changes(void) {
+    char key[24];
+    for (uint8_t layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (uint8_t position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            if (!changed[layer][position]) {
+                continue;
+            }
+
+            const struct zmk_behavior_binding *binding = &bindings[layer][position];
+            const struct binding_setting setting = {
+                .behavior_local_id = zmk_behavior_get_local_id(binding->behavior_dev),
+                .param1 = binding->param1,
+                .param2 = binding->param2,
+            };
+            snprintf(key, sizeof(key), "keymap/l/%d/%d", layer, position);
+            const int err = settings_save_one(key, &setting, sizeof(setting));
+            if (err != 0) {
+                return err;
+            }
+            changed[layer][position] = false;
+        }
+    }
+
+    unsaved = false;
+    return 0;
+}
+
+bool zmk_keymap_check_unsaved_changes(void) {
+    return unsaved;
+}
+
+zmk_keymap_layer_id_t zmk_keymap_layer_index_to_id(const zmk_keymap_layer_index_t layer_index) {
+    return layer_index < ZMK_KEYMAP_LAYERS_LEN ? layer_index : ZMK_KEYMAP_LAYER_ID_INVAL;
+}
+
+const char *zmk_keymap_layer_name(const zmk_keymap_layer_id_t layer_id) {
+    return NULL;
+}
+
+int zmk_keymap_set_layer_name(const zmk_keymap_layer_id_t layer_id, const char *name, const size_t size) {
+    return -ENOTSUP;
+}
+
+int zmk_keymap_move_layer(const zmk_keymap_layer_index_t start_idx, const zmk_keymap_layer_index_t dest_idx) {
+    return -ENOTSUP;
+}
+
+const struct zmk_behavior_binding *zmk_keymap_get_layer_binding_at_idx(const zmk_keymap_layer_id_t layer_id,
+                                                                       const uint8_t binding_idx) {
+    if (layer_id >= ZMK_KEYMAP_LAYERS_LEN || binding_idx >= ZMK_KEYMAP_LEN) {
+        return NULL;
+    }
+
+    ensure_loaded();
+    return &bindings[layer_id][binding_idx];
+}
+
+int zmk_keymap_set_layer_binding_at_idx(const zmk_keymap_layer_id_t layer_id, const uint8_t binding_idx,
+                                        const struct zmk_behavior_binding binding) {
+    if (layer_id >= ZMK_KEYMAP_LAYERS_LEN || binding_idx >= ZMK_KEYMAP_LEN) {
+        return -EINVAL;
+    }
+
+    ensure_loaded();
+    bindings[layer_id][binding_idx] = binding;
+    changed[layer_id][binding_idx] = true;
+    unsaved = true;
+    return 0;
+}